@@ -0,0 +1,185 @@
+/*
+ *  (c) 2025, wilddolphin2022
+ *  For WebRTCsays.ai project
+ *  https://github.com/wilddolphin2022
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree. An additional intellectual property rights grant can be found
+ *  in the file PATENTS.  All contributing project authors may
+ *  be found in the AUTHORS file in the root of the source tree.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+
+// Sample decoders, each turns one input sample into a float in [-1, 1)
+struct Int16Decoder {
+    static float decode(int16_t s) { return static_cast<float>(s) * (1.0f / 32768.0f); }
+};
+
+struct Float32Decoder {
+    static float decode(float s) { return s; }
+};
+
+// G.711 mu-law, decoded through a 256 entry table
+struct MuLawDecoder {
+    static const float* table() {
+        static const struct Table {
+            float v[256];
+            Table() {
+                for (int i = 0; i < 256; ++i) {
+                    const int u = ~i & 0xFF;
+                    const int exponent = (u >> 4) & 0x07;
+                    const int mantissa = u & 0x0F;
+                    int sample = (((mantissa << 3) + 0x84) << exponent) - 0x84;
+                    v[i] = static_cast<float>((u & 0x80) ? -sample : sample) / 32768.0f;
+                }
+            }
+        } t;
+        return t.v;
+    }
+    static float decode(uint8_t s) { return table()[s]; }
+};
+
+// Converts interleaved input of any rate and channel count to mono float at
+// kOutRate in a single pass: decode, downmix and resample happen per output
+// sample, so callers can write straight into the destination buffer.
+//
+// Integer decimation ratios (48k, 32k) average each group of input frames,
+// everything else is linearly interpolated. State carries over between calls
+// so frame boundaries don't click.
+//
+// Usage per chunk:
+//   size_t n = converter.begin(rate, channels, frames);
+//   converter.emit<Int16Decoder>(in, dst, n);   // may be split over several dst regions
+//   converter.finish<Int16Decoder>(in);
+class AudioIngestConverter {
+public:
+    static constexpr int kOutRate = 16000;
+
+    // Set up for a chunk of `frames` input frames, returns the number of output samples
+    size_t begin(int sampleRate, int channels, size_t frames) {
+        if (sampleRate != _inRate || channels != _channels) {
+            reset(sampleRate, channels);
+        }
+        _frames = frames;
+        _inPos = 0;
+
+        if (_inRate == kOutRate) {
+            return frames;
+        }
+        if (_ratio > 1) {
+            return (_accumCount + frames) / _ratio;
+        }
+        // Linear: output k reads input frames floor(p) and floor(p) + 1, p = _phase / kOutRate.
+        // A position on the last frame itself waits for the next chunk, where
+        // it is read back from _last, so floor(p) + 1 stays inside this one.
+        if (frames == 0) {
+            return 0;
+        }
+        const int64_t limit = static_cast<int64_t>(frames - 1) * kOutRate;
+        if (_phase >= limit) {
+            return 0;
+        }
+        return static_cast<size_t>((limit - 1 - _phase) / _inRate) + 1;
+    }
+
+    // Produce the next `count` output samples of the current chunk
+    template <typename Decoder, typename In>
+    void emit(const In* in, float* out, size_t count) {
+        if (_inRate == kOutRate) {
+            const In* p = in + _inPos * _channels;
+            if (_channels == 1) {
+                for (size_t i = 0; i < count; ++i) {
+                    out[i] = Decoder::decode(p[i]);
+                }
+            } else {
+                for (size_t i = 0; i < count; ++i) {
+                    out[i] = frame<Decoder>(p + i * _channels);
+                }
+            }
+            _inPos += count;
+        } else if (_ratio > 1) {
+            const float scale = 1.0f / _ratio;
+            for (size_t i = 0; i < count; ++i) {
+                float sum = _accum;
+                const In* p = in + _inPos * _channels;
+                const size_t need = _ratio - _accumCount;
+                for (size_t j = 0; j < need; ++j) {
+                    sum += frame<Decoder>(p + j * _channels);
+                }
+                _inPos += need;
+                _accum = 0.0f;
+                _accumCount = 0;
+                out[i] = sum * scale;
+            }
+        } else {
+            const float inv = 1.0f / kOutRate;
+            for (size_t i = 0; i < count; ++i) {
+                const int64_t idx = _phase >= 0 ? _phase / kOutRate : -1;
+                const float frac = static_cast<float>(_phase - idx * kOutRate) * inv;
+                const float s0 = idx < 0 ? _last : frame<Decoder>(in + idx * _channels);
+                const float s1 = frame<Decoder>(in + (idx + 1) * _channels);
+                out[i] = s0 + (s1 - s0) * frac;
+                _phase += _inRate;
+            }
+        }
+    }
+
+    // Carry state over to the next chunk once all outputs were emitted
+    template <typename Decoder, typename In>
+    void finish(const In* in) {
+        if (_frames == 0 || _inRate == kOutRate) {
+            return;
+        }
+        if (_ratio > 1) {
+            for (size_t i = _inPos; i < _frames; ++i) {
+                _accum += frame<Decoder>(in + i * _channels);
+                _accumCount++;
+            }
+        } else {
+            _last = frame<Decoder>(in + (_frames - 1) * _channels);
+            _phase -= static_cast<int64_t>(_frames) * kOutRate;
+        }
+    }
+
+    void reset(int sampleRate, int channels) {
+        _inRate = sampleRate;
+        _channels = channels;
+        _ratio = (sampleRate > kOutRate && sampleRate % kOutRate == 0) ? sampleRate / kOutRate : 0;
+        _phase = 0;
+        _last = 0.0f;
+        _accum = 0.0f;
+        _accumCount = 0;
+    }
+
+private:
+    template <typename Decoder, typename In>
+    float frame(const In* p) const {
+        if (_channels == 1) {
+            return Decoder::decode(p[0]);
+        }
+        if (_channels == 2) {
+            return (Decoder::decode(p[0]) + Decoder::decode(p[1])) * 0.5f;
+        }
+        float sum = 0.0f;
+        for (int c = 0; c < _channels; ++c) {
+            sum += Decoder::decode(p[c]);
+        }
+        return sum / _channels;
+    }
+
+    int _inRate = kOutRate;
+    int _channels = 1;
+    size_t _ratio = 0;        // Integer decimation factor, 0 when interpolating
+    size_t _frames = 0;
+    size_t _inPos = 0;        // Next input frame for the direct and decimation paths
+    int64_t _phase = 0;       // Linear path position, in input frames * kOutRate
+    float _last = 0.0f;       // Last frame of the previous chunk, for interpolation
+    float _accum = 0.0f;      // Partial decimation group carried over
+    size_t _accumCount = 0;
+};
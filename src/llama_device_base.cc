@@ -11,10 +11,53 @@
  */
 
 #include <thread>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <llama.h>
 #include "llama_device_base.h"
 #include "whisper_helpers.h"
+#include "peak_memory.h"
+
+static const int32_t kDraftTokens = 8;       // Speculative tokens per target decode
+static const size_t kLookupMaxNgram = 4;     // Longest suffix matched by prompt lookup
+static const size_t kLookupMinNgram = 2;
+
+static WhillatsLlamaStopReason ToStopReason(LlamaStopReason reason)
+{
+  switch (reason)
+  {
+  case LlamaStopReason::StopString:
+    return WhillatsLlamaStopReason::StopString;
+  case LlamaStopReason::Repetition:
+    return WhillatsLlamaStopReason::Repetition;
+  case LlamaStopReason::Confirmation:
+    return WhillatsLlamaStopReason::Confirmation;
+  default:
+    return WhillatsLlamaStopReason::EndOfGeneration;
+  }
+}
+
+// Saved session file: this header, the dialogue tokens, the turn spans, the
+// messages as length prefixed role and content, then the KV sequence state
+// from llama_state_seq_get_data. Native byte order, it stays on one machine.
+static const char kSessionMagic[4] = {'W', 'L', 'S', 'S'};
+static const uint32_t kSessionVersion = 2;
+
+struct LlamaSessionHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t model_fingerprint;
+  uint64_t n_tokens;
+  uint64_t n_turns;
+  uint64_t n_messages;
+  uint64_t formatted_len;
+  uint64_t replayed_messages;        // Trailing messages to prefill with the next turn
+  uint64_t state_size;
+};
 
 LlamaSimpleChat::LlamaSimpleChat() = default;
 
@@ -24,12 +67,12 @@ LlamaSimpleChat::~LlamaSimpleChat()
   {
     llama_sampler_free(smpl_);
   }
-
-  FreeContext();
-  if (model_)
+  if (draft_smpl_)
   {
-    llama_model_free(model_);
+    llama_sampler_free(draft_smpl_);
   }
+
+  FreeContext();
 }
 
 bool LlamaSimpleChat::SetModelPath(const std::string &path)
@@ -46,10 +89,15 @@ bool LlamaSimpleChat::SetNGL(int layers)
 
 bool LlamaSimpleChat::SetContextSize(int size)
 {
-  n_predict_ = size;
+  config_.session_ctx = size;
   return true;
 }
 
+void LlamaSimpleChat::SetConfig(const WhillatsLlamaConfig &config)
+{
+  config_ = config;
+}
+
 void LlamaSimpleChat::StopGeneration()
 {
   continue_ = false;
@@ -57,400 +105,2179 @@ void LlamaSimpleChat::StopGeneration()
 
 bool LlamaSimpleChat::Initialize()
 {
-  ggml_backend_load_all();
-  return LoadModel() && InitializeContext();
+  if (!LoadModel() || !InitializeContext())
+  {
+    return false;
+  }
+  if (!draft_model_path_.empty() && !LoadDraftModel())
+  {
+    LOG_W("Draft model unavailable, generating without speculative decoding");
+  }
+  return true;
 }
 
+// The model is shared, every chat on the same path gets the same engine
 bool LlamaSimpleChat::LoadModel()
 {
-  if (model_path_.empty())
+  auto start = std::chrono::steady_clock::now();
+  engine_ = LlamaEngine::Acquire(model_path_, ngl_, config_);
+  if (!engine_)
   {
-    LOG_E("Model path not set.");
     return false;
   }
-
-  llama_model_params model_params = llama_model_default_params();
-  model_params.n_gpu_layers = ngl_;
-  model_ = llama_model_load_from_file(model_path_.c_str(), model_params);
-  if (!model_)
   {
-    LOG_E("Unable to load model.");
-    return false;
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.model_acquire_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    stats_.model_load_ms = engine_->LoadMs();
   }
-  vocab_ = llama_model_get_vocab(model_);
+  max_context_tokens_ = std::min<size_t>(config_.session_ctx, llama_n_ctx(engine_->context()));
+
+  model_ = engine_->model();
+  vocab_ = engine_->vocab();
+  ctx_ = engine_->context();
   return true;
 }
 
 bool LlamaSimpleChat::InitializeContext()
 {
-  if (ctx_)
+  if (!engine_)
   {
-    FreeContext();
+    LOG_E("Model or vocab not loaded.");
+    return false;
   }
 
-  if (!model_ || !vocab_)
+  FreeContext();
   {
-    LOG_E("Model or vocab not loaded.");
+    std::lock_guard<std::mutex> lock(engine_->mutex());
+    seq_id_ = engine_->AcquireSequence();
+  }
+  if (seq_id_ < 0)
+  {
+    LOG_E("Failed to get a sequence in the llama_context.");
     return false;
   }
+  session_started_ = false;
 
-  // Tokenize the prompt
-  const int n_prompt = -llama_tokenize(vocab_, prompt_.c_str(), prompt_.size(), NULL, 0, true, true);
-  std::vector<llama_token> prompt_tokens(n_prompt);
-  if (llama_tokenize(vocab_, prompt_.c_str(), prompt_.size(), prompt_tokens.data(), prompt_tokens.size(), true, true) < 0)
+  // Initialize sampler
+  if (!smpl_)
   {
-    LOG_E("Failed to tokenize the prompt.");
-    return false;
+    BuildSampler();
   }
 
-  // Setup context parameters
-  llama_context_params ctx_params = llama_context_default_params();
-  ctx_params.n_ctx = n_prompt + n_predict_ - 1;
-  ctx_params.n_batch = n_prompt;
-  ctx_params.no_perf = false;
+  return true;
+}
 
-  ctx_ = llama_init_from_model(model_, ctx_params);
-  if (!ctx_)
+void LlamaSimpleChat::SetSampler(const WhillatsSamplerConfig &config)
+{
+  if (config.mode == sampler_config_.mode && config.temperature == sampler_config_.temperature &&
+      config.min_p == sampler_config_.min_p && config.top_k == sampler_config_.top_k &&
+      config.top_p == sampler_config_.top_p && config.seed == sampler_config_.seed)
   {
-    LOG_E("Failed to create the llama_context.");
-    return false;
+    return;
+  }
+  sampler_config_ = config;
+  if (smpl_)
+  {
+    llama_sampler_free(smpl_);
+    smpl_ = nullptr;
+    BuildSampler();
   }
+}
 
-  // Initialize sampler
+// Sample() does greedy without the chain, a greedy one stands in for it
+void LlamaSimpleChat::BuildSampler()
+{
+  const WhillatsSamplerConfig &config = sampler_config_;
   smpl_ = llama_sampler_chain_init(llama_sampler_chain_default_params());
-  llama_sampler_chain_add(smpl_, llama_sampler_init_min_p(0.05f, 1));
-  llama_sampler_chain_add(smpl_, llama_sampler_init_temp(0.8f));
-  llama_sampler_chain_add(smpl_, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-
-  return true;
+  if (config.mode == WhillatsSamplerMode::Greedy)
+  {
+    llama_sampler_chain_add(smpl_, llama_sampler_init_greedy());
+    return;
+  }
+  if (config.mode == WhillatsSamplerMode::TopKTopP)
+  {
+    llama_sampler_chain_add(smpl_, llama_sampler_init_top_k(config.top_k));
+    llama_sampler_chain_add(smpl_, llama_sampler_init_top_p(config.top_p, 1));
+  }
+  else
+  {
+    llama_sampler_chain_add(smpl_, llama_sampler_init_min_p(config.min_p, 1));
+  }
+  llama_sampler_chain_add(smpl_, llama_sampler_init_temp(config.temperature));
+  llama_sampler_chain_add(smpl_, llama_sampler_init_dist(config.seed));
 }
 
 void LlamaSimpleChat::FreeContext()
 {
-  if (ctx_)
+  if (engine_)
+  {
+    std::lock_guard<std::mutex> lock(engine_->mutex());
+    ReleasePrefix();
+    engine_->ReleaseSequence(seq_id_);
+    seq_id_ = -1;
+  }
+  if (draft_engine_ && draft_seq_ >= 0)
   {
-    llama_free(ctx_);
-    ctx_ = nullptr;
+    std::lock_guard<std::mutex> lock(draft_engine_->mutex());
+    draft_engine_->ReleaseSequence(draft_seq_);
+    draft_seq_ = -1;
+    draft_past_ = 0;
   }
 }
 
-// Add helper function to detect repetition
-bool LlamaSimpleChat::isRepetitive(const std::string &text, size_t minPatternLength)
+// The draft model gets an engine of its own, shared like the target's, and
+// is only ever decoded from the target's engine thread
+bool LlamaSimpleChat::LoadDraftModel()
 {
-  if (text.length() < minPatternLength * 2)
+  // Drafting locks the draft engine from inside the target's decode step, so
+  // the two can't be one engine
+  if (draft_model_path_ == model_path_)
+  {
+    LOG_W("Draft model is the main model " << model_path_ << ", ignoring it");
+    return false;
+  }
+  draft_engine_ = LlamaEngine::Acquire(draft_model_path_, ngl_, config_);
+  if (!draft_engine_)
   {
     return false;
   }
+  if (draft_engine_ == engine_)
+  {
+    LOG_W("Draft model " << draft_model_path_ << " resolves to the main model's engine, ignoring it");
+    draft_engine_.reset();
+    return false;
+  }
 
-  // Check for immediate repetition of phrases
-  for (size_t len = minPatternLength; len <= text.length() / 2; ++len)
+  if (llama_vocab_n_tokens(draft_engine_->vocab()) != llama_vocab_n_tokens(vocab_))
   {
-    std::string last = text.substr(text.length() - len);
-    size_t pos = text.rfind(last, text.length() - len - 1);
-    if (pos != std::string::npos)
-    {
-      return true;
-    }
+    LOG_E("Draft model vocabulary doesn't match the target model");
+    draft_engine_.reset();
+    return false;
   }
-  return false;
+
+  {
+    std::lock_guard<std::mutex> lock(draft_engine_->mutex());
+    draft_seq_ = draft_engine_->AcquireSequence();
+  }
+  if (draft_seq_ < 0)
+  {
+    draft_engine_.reset();
+    return false;
+  }
+  draft_past_ = 0;
+
+  if (!draft_smpl_)
+  {
+    draft_smpl_ = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(draft_smpl_, llama_sampler_init_greedy());
+  }
+  return true;
 }
 
-// Add helper to check for confirmation patterns
-bool LlamaSimpleChat::hasConfirmationPattern(const std::string &text)
+void LlamaSimpleChat::ResetSession()
 {
-  static const std::vector<std::string> patterns = {
-      "yeah", "okay", "so", "right", "think",
-      "that's", "correct", "makes sense"};
-
-  size_t matches = 0;
-  std::string lower = text;
-  std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+  session_started_ = false;
+}
 
-  for (const auto &pattern : patterns)
+// Not with the engine mutex held, the old prompt's prefix is let go of here
+void LlamaSimpleChat::SetSystemPrompt(const std::string &prompt)
+{
+  if (prompt != system_prompt_)
   {
-    if (lower.find(pattern) != std::string::npos)
+    system_prompt_ = prompt;
+    if (engine_)
     {
-      matches++;
-      if (matches >= 3)
-      { // If we see multiple confirmation words
-        return true;
-      }
+      std::lock_guard<std::mutex> lock(engine_->mutex());
+      ReleasePrefix();
     }
   }
-  return false;
 }
 
-std::string LlamaSimpleChat::generate(const std::string &prompt, WhillatsSetResponseCallback callback)
+void LlamaSimpleChat::SetStopStrings(const std::vector<std::string> &stops)
+{
+  stop_strings_ = stops;
+  stop_engine_.setStopStrings(stops);
+}
+
+std::string LlamaSimpleChat::ResponseCacheKey(const std::string &prompt) const
 {
-  // Tokenize the prompt
-  const struct llama_vocab *vocab = llama_model_get_vocab(model_);
+  // A fresh session is just its system prompt, whether or not it started
+  const bool has_system = !messages_.empty() && messages_[0].first == "system";
+  const WhillatsSamplerConfig &sampler = sampler_config_;
+  // The model that answers, also by its weights for a swap on the same path
+  std::string context = "model " + model_path_ + " " + std::to_string(engine_ ? engine_->fingerprint() : 0) + "\n";
+  context += "sampling " + std::to_string(static_cast<int>(sampler.mode)) +
+                        " temp=" + std::to_string(sampler.temperature) +
+                        " min_p=" + std::to_string(sampler.min_p) +
+                        " top_k=" + std::to_string(sampler.top_k) +
+                        " top_p=" + std::to_string(sampler.top_p) +
+                        " seed=" + std::to_string(sampler.seed) + "\n";
+  for (const std::string &stop : stop_strings_)
+  {
+    context += stop + "\n";
+  }
+  if (!session_started_ || messages_.size() <= (has_system ? 1u : 0u))
+  {
+    context += system_prompt_;
+  }
+  else
+  {
+    context += ApplyChatTemplate(false);
+  }
 
-  const int n_tokens = -llama_tokenize(vocab, prompt.c_str(), prompt.size(), nullptr, 0, true, false);
-  if (n_tokens < 0)
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : context)
   {
-    LOG_E("Failed to count prompt tokens");
-    return "";
+    hash = (hash ^ (uint8_t)c) * 1099511628211ull;
   }
+  char prefix[24];
+  snprintf(prefix, sizeof(prefix), "%016llx\n", (unsigned long long)hash);
+  return prefix + normalizeText(prompt);
+}
 
-  std::vector<llama_token> tokens(n_tokens);
-  if (llama_tokenize(vocab, prompt.c_str(), prompt.size(), tokens.data(), tokens.size(), true, false) < 0)
+// Add a turn answered elsewhere to the dialogue, its text is prefilled with
+// the next turn here
+void LlamaSimpleChat::AppendTurn(const std::string &prompt, const std::string &response)
+{
   {
-    LOG_E("Failed to tokenize prompt");
-    return "";
+    std::lock_guard<std::mutex> lock(engine_->mutex());
+    if (!session_started_ && !StartSession())
+    {
+      return;
+    }
   }
+  messages_.push_back(std::make_pair(std::string("user"), prompt));
+  messages_.push_back(std::make_pair(std::string("assistant"), response));
+  replayed_messages_ += 2;
+}
 
-  // Create batch for prompt processing
-  llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
+// Start over with another chat's dialogue, all of it to be prefilled
+void LlamaSimpleChat::AdoptDialogue(const std::vector<std::pair<std::string, std::string>> &messages)
+{
+  if (!messages.empty() && messages.front().first == "system")
+  {
+    SetSystemPrompt(messages.front().second);
+  }
+  {
+    std::lock_guard<std::mutex> lock(engine_->mutex());
+    if (!StartSession())
+    {
+      return;
+    }
+  }
+  const size_t first = (!messages.empty() && messages.front().first == "system") ? 1 : 0;
+  messages_.insert(messages_.end(), messages.begin() + first, messages.end());
+  replayed_messages_ = messages.size() - first;
+}
 
-  if (llama_decode(ctx_, batch))
+// Deliver a cached answer through the callbacks and add the turn to the
+// dialogue without decoding anything now
+void LlamaSimpleChat::ReplayTurn(const std::string &prompt, const LlamaCachedResponse &cached,
+                                 WhillatsSetResponseCallback callback, WhillatsSetTokenCallback token_callback,
+                                 WhillatsSetDoneCallback done_callback)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < cached.tokens.size() && token_callback.enabled(); ++i)
   {
-    LOG_E("Failed to process prompt");
-    return "";
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    WhillatsLlamaToken token = {cached.tokens[i].c_str(), (uint32_t)i, ms, 0};
+    token_callback.OnToken(token);
   }
+  for (const std::string &phrase : cached.phrases)
+  {
+    callback.OnResponseComplete(true, phrase.c_str());
+  }
+  _lastResponseEnd = std::chrono::steady_clock::now();
+  LOG_V("Llama says (cached): '" << cached.response << "'");
 
-  // Initialize generation
-  std::string response;
-  std::string current_phrase;
-  std::string recent_text; // For pattern detection
-  continue_ = true;
+  AppendTurn(prompt, cached.response);
+  done_callback.OnDone(WhillatsLlamaStopReason::Cached, cached.response.c_str());
 
-  const int max_response_tokens = 256;
-  const int max_repetition_window = 50; // Characters to check for repetition
-  int generated_tokens = 0;
-  int unchanged_count = 0;    // Counter for unchanged text
-  int confirmation_count = 0; // Counter for confirmation patterns
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_.turns++;
+  stats_.ttft_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
 
-  // Initialize sampler chain if needed
-  if (!smpl_)
+void LlamaSimpleChat::SetDraftModelPath(const std::string &path)
+{
+  draft_model_path_ = path;
+}
+
+void LlamaSimpleChat::SetSpeculativeMode(WhillatsSpeculativeMode mode)
+{
+  if (mode == WhillatsSpeculativeMode::DraftModel && !draft_engine_)
   {
-    auto params = llama_sampler_chain_default_params();
-    smpl_ = llama_sampler_chain_init(params);
-    llama_sampler_chain_add(smpl_, llama_sampler_init_top_k(40));
-    llama_sampler_chain_add(smpl_, llama_sampler_init_top_p(0.95f, 1));
-    llama_sampler_chain_add(smpl_, llama_sampler_init_temp(0.8f));
-    llama_sampler_chain_add(smpl_, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    LOG_V("No draft model loaded, speculative decoding stays off");
+    mode = WhillatsSpeculativeMode::None;
   }
+  speculative_mode_ = mode;
+}
 
-  // Generation loop
-  while (continue_ && generated_tokens < max_response_tokens)
+WhillatsLlamaStats LlamaSimpleChat::GetStats() const
+{
+  WhillatsLlamaStats stats;
   {
-    if (!continue_)
-    {
-      break; // Immediate interrupt check
-    }
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats = stats_;
+  }
+  if (engine_)
+  {
+    stats.model_warmup_ms = engine_->WarmupMs();
+    stats.kv_bytes_per_token = engine_->KVBytesPerToken();
+    stats.kv_session_bytes = stats.kv_bytes_per_token * stats.context_tokens;
+    stats.kv_total_bytes = stats.kv_bytes_per_token * llama_n_ctx(engine_->context());
+    stats.engine_active_jobs = engine_->ActiveJobs();
+    stats.engine_tokens_per_s = engine_->TokensPerSecond();
+    stats.engine_batch_jobs_avg = engine_->AverageBatchJobs();
+  }
+  return stats;
+}
 
-    // Sample next token
-    llama_token new_token_id = llama_sampler_sample(smpl_, ctx_, -1);
+// Begin a new dialogue: drop the session sequence and start it from the
+// system prompt prefix. Called with the engine mutex held.
+bool LlamaSimpleChat::StartSession()
+{
+  auto start = std::chrono::steady_clock::now();
+
+  llama_kv_cache_seq_rm(ctx_, seq_id_, -1, -1);
+  SyncDraft(0);
+  messages_.clear();
+  context_tokens_.clear();
+  turns_.clear();
+  replayed_messages_ = 0;
+  formatted_len_ = 0;
+  session_started_ = true;
+
+  if (system_prompt_.empty())
+  {
+    return true;
+  }
 
-    if (new_token_id == llama_vocab_eos(vocab))
-    {
-      break;
-    }
+  // Without a prefix the system message is simply prefilled with the first turn
+  messages_.push_back(std::make_pair(std::string("system"), system_prompt_));
+  if (!RestorePrefix())
+  {
+    LOG_W("System prompt prefix unavailable, prefilling it with the first turn");
+    return true;
+  }
 
-    // Convert token to text
-    char token_text[8];
-    int token_text_len = llama_token_to_piece(vocab, new_token_id, token_text, sizeof(token_text), 0, true);
-    if (token_text_len < 0)
-    {
-      break;
-    }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  LOG_I("Session started from " << prefix_->tokens.size() << " prefix tokens in " << ms
+        << " ms, prefill would take " << prefix_->prefill_ms << " ms");
 
-    // Process the generated piece
-    std::string piece(token_text, token_text_len);
-    current_phrase += piece;
-    recent_text += piece;
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_.sessions_started++;
+  stats_.session_start_ms = ms;
+  stats_.prefix_prefill_ms = prefix_->prefill_ms;
+  stats_.prefix_saved_ms += std::max(0.0, prefix_->prefill_ms - ms);
+  return true;
+}
 
-    // Keep recent_text to a manageable size
-    if (recent_text.length() > max_repetition_window)
+// Put the system prompt prefix at the start of the session sequence. The
+// prefix stays resident in its own engine sequence and is copied, which
+// shares the KV cells, so only the first chat per model and prompt decodes it.
+bool LlamaSimpleChat::RestorePrefix()
+{
+  const std::string key = model_path_ + "\n" + system_prompt_;
+  llama_seq_id prefix_seq = prefix_key_ == key ? engine_->PrefixSequence(prefix_key_, prefix_) : -1;
+  if (prefix_seq < 0)
+  {
+    // Evicted since, or never taken
+    ReleasePrefix();
+    std::shared_ptr<const LlamaPrefixSnapshot> snapshot;
+    prefix_seq = engine_->AcquirePrefix(key, snapshot);
+    if (prefix_seq >= 0)
     {
-      recent_text = recent_text.substr(recent_text.length() - max_repetition_window);
+      prefix_ = snapshot;
+      prefix_key_ = key;
     }
-
-    // Check for natural response end conditions
-    bool should_end = false;
-
-    // 1. Check for repetitive patterns
-    if (isRepetitive(recent_text))
+    else if (!BuildPrefix(key))
     {
-      unchanged_count++;
-      if (unchanged_count > 3)
-      { // Allow some repetition before breaking
-        should_end = true;
-      }
+      return false;
     }
     else
     {
-      unchanged_count = 0;
+      prefix_seq = engine_->PrefixSequence(prefix_key_, prefix_);
     }
+  }
 
-    // 2. Check for excessive confirmation patterns
-    if (hasConfirmationPattern(current_phrase))
-    {
-      confirmation_count++;
-      if (confirmation_count > 2)
-      { // Break if too many confirmation patterns
-        should_end = true;
-      }
-    }
-
-    // Process completed phrases
-    if (piece.find_first_of(".!?") != std::string::npos || should_end)
-    {
-      if (!current_phrase.empty())
-      {
-        callback.OnResponseComplete(true, current_phrase.c_str());
-
-        _lastResponseEnd = std::chrono::steady_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                _lastResponseEnd - _lastResponseStart).count();
-        std::cout << "Llama says: '" << current_phrase << "' in " << duration << " ms";
-
-      }
-      response += current_phrase;
-      current_phrase.clear();
-
-      if (should_end)
-      {
-        break;
-      }
-    }
+  llama_kv_cache_seq_cp(ctx_, prefix_seq, seq_id_, -1, -1);
+  context_tokens_ = prefix_->tokens;
+  formatted_len_ = prefix_->formatted_len;
+  return true;
+}
 
-    // Prepare next token
-    batch = llama_batch_get_one(&new_token_id, 1);
-    if (llama_decode(ctx_, batch))
-    {
-      break;
-    }
+// Decode the system prompt into a sequence of its own and publish it
+bool LlamaSimpleChat::BuildPrefix(const std::string &key)
+{
+  auto start = std::chrono::steady_clock::now();
+  auto snapshot = std::make_shared<LlamaPrefixSnapshot>();
 
-    generated_tokens++;
+  const llama_seq_id seq_id = engine_->AcquireSequence();
+  if (seq_id < 0)
+  {
+    return false;
   }
 
-  // Handle any remaining text
-  if (!current_phrase.empty())
+  // messages_ holds just the system message at this point
+  const std::string formatted = ApplyChatTemplate(false);
+  context_tokens_.clear();
+  if (formatted.empty() || !TokenizeTurn(formatted, snapshot->tokens) ||
+      !engine_->DecodeSequence(snapshot->tokens, seq_id, 0))
   {
-    callback.OnResponseComplete(true, current_phrase.c_str());
-    response += current_phrase;
-
-    _lastResponseEnd = std::chrono::steady_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-            _lastResponseEnd - _lastResponseStart).count();
-    std::cout << "Llama says: '" << current_phrase << "' in " << duration << " ms" << std::endl;
+    engine_->ReleaseSequence(seq_id);
+    return false;
   }
+  snapshot->formatted_len = formatted.size();
+  snapshot->prefill_ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
 
-  return response;
-}
+  LOG_I("System prompt prefilled: " << snapshot->tokens.size() << " tokens in " << snapshot->prefill_ms << " ms");
 
-//
-// Llama device base
-//
+  engine_->AddPrefix(key, seq_id, snapshot);
+  prefix_ = snapshot;
+  prefix_key_ = key;
+  return true;
+}
 
-LlamaDeviceBase::LlamaDeviceBase(
-    const char*model_path,
-    WhillatsSetResponseCallback callback)
-    : _model_path(model_path),
-      _responseCallback(callback)
+// Let go of this chat's reference to its prefix. Caller holds the engine mutex.
+void LlamaSimpleChat::ReleasePrefix()
 {
+  if (prefix_)
+  {
+    engine_->ReleasePrefix(prefix_key_, prefix_);
+  }
+  prefix_.reset();
+  prefix_key_.clear();
 }
 
-LlamaDeviceBase::~LlamaDeviceBase() {}
-
-void LlamaDeviceBase::askLlama(const char* prompt)
+// Write the dialogue and its KV sequence to path, through a temporary file so
+// a crash never leaves a truncated session behind
+bool LlamaSimpleChat::SaveSession(const std::string &path)
 {
+  auto start = std::chrono::steady_clock::now();
+  if (!engine_ || seq_id_ < 0 || !session_started_)
   {
-    std::unique_lock<std::mutex> lock(_queueMutex);
-    if (prompt && *prompt)
+    LOG_E("No session to save");
+    return false;
+  }
+
+  std::vector<uint8_t> state;
+  {
+    std::lock_guard<std::mutex> lock(engine_->mutex());
+    state.resize(llama_state_seq_get_size(ctx_, seq_id_));
+    state.resize(llama_state_seq_get_data(ctx_, state.data(), state.size(), seq_id_));
+  }
+  if (state.empty())
+  {
+    LOG_E("Failed to read the KV state of sequence " << seq_id_);
+    return false;
+  }
+
+  LlamaSessionHeader header;
+  std::memcpy(header.magic, kSessionMagic, sizeof(header.magic));
+  header.version = kSessionVersion;
+  header.model_fingerprint = engine_->fingerprint();
+  header.n_tokens = context_tokens_.size();
+  header.n_turns = turns_.size();
+  header.n_messages = messages_.size();
+  header.formatted_len = formatted_len_;
+  header.replayed_messages = replayed_messages_;
+  header.state_size = state.size();
+
+  const std::string tmp_path = path + ".tmp";
+  FILE *file = std::fopen(tmp_path.c_str(), "wb");
+  if (!file)
+  {
+    LOG_E("Unable to write session file " << tmp_path);
+    return false;
+  }
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && std::fwrite(context_tokens_.data(), sizeof(llama_token), context_tokens_.size(), file) ==
+                 context_tokens_.size();
+  for (const LlamaTurnSpan &turn : turns_)
+  {
+    const uint64_t span[2] = {turn.message, turn.token};
+    ok = ok && std::fwrite(span, sizeof(span), 1, file) == 1;
+  }
+  for (const auto &message : messages_)
+  {
+    for (const std::string *text : {&message.first, &message.second})
     {
-      _textQueue.push(std::string(prompt));
+      const uint32_t length = text->size();
+      ok = ok && std::fwrite(&length, sizeof(length), 1, file) == 1;
+      ok = ok && std::fwrite(text->data(), 1, length, file) == length;
     }
   }
+  ok = ok && std::fwrite(state.data(), 1, state.size(), file) == state.size();
+  const long size = std::ftell(file);
+  ok = std::fclose(file) == 0 && ok;
+  if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+  {
+    LOG_E("Failed to write session file " << path);
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  LOG_I("Session saved to " << path << ": " << context_tokens_.size() << " tokens, " << size << " bytes in "
+        << ms << " ms");
+
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_.session_save_ms = ms;
+  stats_.session_file_bytes = size;
+  return true;
 }
 
-bool LlamaDeviceBase::RunProcessingThread()
+// Replace the dialogue with a saved one. The file is mapped rather than read,
+// the KV state goes from the page cache straight into the sequence.
+bool LlamaSimpleChat::LoadSession(const std::string &path)
 {
+  auto start = std::chrono::steady_clock::now();
+  if (!engine_ || seq_id_ < 0)
+  {
+    LOG_E("Chat not initialized, can't load a session");
+    return false;
+  }
 
-  while (_running)
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    LOG_E("Unable to open session file " << path);
+    return false;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(LlamaSessionHeader))
+  {
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED)
   {
-    std::string textToAsk;
-    bool shouldAsk = false;
+    LOG_E("Unable to map session file " << path);
+    return false;
+  }
 
+  const uint8_t *data = static_cast<const uint8_t *>(map);
+  const size_t size = st.st_size;
+  size_t offset = 0;
+  auto take = [&](void *dst, size_t n) {
+    if (n > size - offset)
     {
-      std::unique_lock<std::mutex> lock(_queueMutex);
-      if (!_textQueue.empty())
+      return false;
+    }
+    std::memcpy(dst, data + offset, n);
+    offset += n;
+    return true;
+  };
+
+  LlamaSessionHeader header;
+  take(&header, sizeof(header));
+  bool ok = false;
+  std::vector<llama_token> tokens;
+  std::vector<LlamaTurnSpan> turns;
+  std::vector<std::pair<std::string, std::string>> messages;
+  if (std::memcmp(header.magic, kSessionMagic, sizeof(header.magic)) != 0 || header.version != kSessionVersion)
+  {
+    LOG_W("Session file " << path << " has an unknown format");
+  }
+  else if (header.model_fingerprint != engine_->fingerprint())
+  {
+    LOG_W("Session file " << path << " was saved with a different model");
+  }
+  else if (header.n_tokens > size / sizeof(llama_token) || header.state_size > size)
+  {
+    LOG_W("Session file " << path << " is truncated");
+  }
+  else
+  {
+    ok = true;
+    tokens.resize(header.n_tokens);
+    ok = take(tokens.data(), tokens.size() * sizeof(llama_token));
+    for (uint64_t i = 0; ok && i < header.n_turns; ++i)
+    {
+      uint64_t span[2];
+      ok = take(span, sizeof(span));
+      turns.push_back(LlamaTurnSpan{(size_t)span[0], (size_t)span[1]});
+    }
+    for (uint64_t i = 0; ok && i < header.n_messages; ++i)
+    {
+      std::pair<std::string, std::string> message;
+      for (std::string *text : {&message.first, &message.second})
       {
-        textToAsk = _textQueue.front();
-        _textQueue.pop();
-        shouldAsk = true;
-        std::cout << "Asked: '" << textToAsk << "'" << std::endl;
+        uint32_t length = 0;
+        ok = ok && take(&length, sizeof(length)) && length <= size - offset;
+        if (ok)
+        {
+          text->assign(reinterpret_cast<const char *>(data + offset), length);
+          offset += length;
+        }
       }
+      messages.push_back(std::move(message));
     }
-
-    if (shouldAsk)
+    ok = ok && header.state_size == size - offset && header.replayed_messages <= messages.size();
+    if (!ok)
     {
-      _llama_chat->_lastResponseStart = std::chrono::steady_clock::now();
-      _llama_chat->generate(textToAsk, _responseCallback);
-      textToAsk.clear();
+      LOG_W("Session file " << path << " is corrupt");
     }
-
-    // Sleep if no data available to read to prevent busy-waiting
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
   }
 
-  return true;
-}
-
-bool LlamaDeviceBase::start()
-{
-  if (!_running)
+  if (ok)
   {
-    _llama_chat.reset(new LlamaSimpleChat());
-    _llama_chat->SetModelPath(_model_path);
-    if (_llama_chat && _llama_chat->Initialize())
+    std::lock_guard<std::mutex> lock(engine_->mutex());
+    llama_kv_cache_seq_rm(ctx_, seq_id_, -1, -1);
+    SyncDraft(0);
+    ok = llama_state_seq_set_data(ctx_, data + offset, header.state_size, seq_id_) == header.state_size;
+    if (!ok)
     {
-      LOG_V("Llama chat initialized!");
-    } else {
-      LOG_E("Failed to initialize Llama chat");
-      return false;
+      LOG_E("Failed to restore the KV state from " << path << ", the context may be too small");
+      llama_kv_cache_seq_rm(ctx_, seq_id_, -1, -1);
+      session_started_ = false;
     }
+  }
+  munmap(map, size);
+  if (!ok)
+  {
+    return false;
+  }
 
-    _running = true;
-    _processingThread = std::thread([this] {
-      while (_running && RunProcessingThread()) {
-      } 
-    });
+  context_tokens_ = std::move(tokens);
+  turns_ = std::move(turns);
+  messages_ = std::move(messages);
+  formatted_len_ = header.formatted_len;
+  replayed_messages_ = header.replayed_messages;
+  session_started_ = true;
+  if (!messages_.empty() && messages_.front().first == "system")
+  {
+    SetSystemPrompt(messages_.front().second);
   }
 
-  return _running;
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  LOG_I("Session restored from " << path << ": " << context_tokens_.size() << " tokens in " << ms << " ms");
+
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_.session_restore_ms = ms;
+  stats_.session_file_bytes = size;
+  stats_.context_tokens = context_tokens_.size();
+  return true;
 }
 
-void LlamaDeviceBase::stop()
+// Render the whole conversation through the model's chat template
+std::string LlamaSimpleChat::ApplyChatTemplate(bool add_assistant) const
 {
-  if (_running)
+  std::vector<llama_chat_message> chat;
+  chat.reserve(messages_.size());
+  for (const auto &message : messages_)
   {
-    _running = false;
+    chat.push_back({message.first.c_str(), message.second.c_str()});
+  }
+
+  // A null template makes llama.cpp fall back to chatml
+  const char *tmpl = llama_model_chat_template(model_, nullptr);
+  std::vector<char> formatted(1024);
+  int len = llama_chat_apply_template(tmpl, chat.data(), chat.size(), add_assistant, formatted.data(), formatted.size());
+  if (len > (int)formatted.size())
+  {
+    formatted.resize(len);
+    len = llama_chat_apply_template(tmpl, chat.data(), chat.size(), add_assistant, formatted.data(), formatted.size());
+  }
+  if (len < 0)
+  {
+    LOG_E("Failed to apply the chat template");
+    return "";
+  }
+  return std::string(formatted.data(), len);
+}
+
+bool LlamaSimpleChat::TokenizeTurn(const std::string &text, std::vector<llama_token> &tokens) const
+{
+  // BOS only at the very start of the KV cache, specials come from the template
+  const bool add_bos = context_tokens_.empty();
+  const int n_tokens = -llama_tokenize(vocab_, text.c_str(), text.size(), nullptr, 0, add_bos, true);
+  if (n_tokens < 0)
+  {
+    LOG_E("Failed to count prompt tokens");
+    return false;
+  }
+
+  tokens.resize(n_tokens);
+  if (llama_tokenize(vocab_, text.c_str(), text.size(), tokens.data(), tokens.size(), add_bos, true) < 0)
+  {
+    LOG_E("Failed to tokenize prompt");
+    return false;
+  }
+  return true;
+}
+
+// Make room for a turn's prefill plus a response. When the turn doesn't fit,
+// the oldest turns are shifted out of the KV cache. Where the context can't
+// shift, the session restarts from the system prompt prefix and tokens gets
+// replaced with the rest of the history that is kept.
+bool LlamaSimpleChat::TrimContext(std::vector<llama_token> &tokens)
+{
+  const size_t limit = max_context_tokens_;
+  if (context_tokens_.size() + tokens.size() + response_reserve_tokens_ <= limit)
+  {
+    return true;
+  }
+
+  if (llama_kv_cache_can_shift(ctx_) && ShiftContext(tokens) &&
+      context_tokens_.size() + tokens.size() + response_reserve_tokens_ <= limit)
+  {
+    return true;
+  }
+
+  llama_kv_cache_seq_rm(ctx_, seq_id_, -1, -1);
+  SyncDraft(0);
+  context_tokens_.clear();
+  turns_.clear();
+  formatted_len_ = 0;
+  // An evicted prefix leaves the system message to be prefilled again
+  const llama_seq_id prefix_seq = prefix_ ? engine_->PrefixSequence(prefix_key_, prefix_) : -1;
+  if (prefix_seq >= 0)
+  {
+    llama_kv_cache_seq_cp(ctx_, prefix_seq, seq_id_, -1, -1);
+    context_tokens_ = prefix_->tokens;
+    formatted_len_ = prefix_->formatted_len;
+  }
+
+  // Keep the system message and the new user turn, which is the last message
+  const size_t first = (!messages_.empty() && messages_[0].first == "system") ? 1 : 0;
+  while (true)
+  {
+    if (!TokenizeTurn(ApplyChatTemplate(true).substr(formatted_len_), tokens))
+    {
+      return false;
+    }
+    if (context_tokens_.size() + tokens.size() + response_reserve_tokens_ <= limit ||
+        messages_.size() <= first + 1)
+    {
+      break;
+    }
+    messages_.erase(messages_.begin() + first,
+                    messages_.begin() + first + std::min<size_t>(2, messages_.size() - first - 1));
+  }
+
+  // Everything after the prefix is prefilled again with this turn
+  turn_message_ = formatted_len_ > 0 ? first : 0;
+  replayed_messages_ = messages_.size() - 1 - turn_message_;
+  LOG_I("Context trimmed to " << messages_.size() << " messages");
+  return true;
+}
+
+// Drop the oldest turns from the session sequence in place: remove their
+// cells and move the later ones down, which keeps the system prefix and the
+// rest of the dialogue decoded. Retokenizes the new turn, the last message,
+// against the shorter history.
+bool LlamaSimpleChat::ShiftContext(std::vector<llama_token> &tokens)
+{
+  auto start = std::chrono::steady_clock::now();
+
+  // A turn that covers the system message, when it wasn't restored as a
+  // prefix, has to stay
+  const bool has_system = !messages_.empty() && messages_[0].first == "system";
+  const size_t keep = (!turns_.empty() && has_system && turns_[0].message == 0) ? 1 : 0;
+  if (turns_.size() <= keep)
+  {
+    return false;
+  }
+
+  const size_t p0 = turns_[keep].token;
+  size_t drop = keep;
+  size_t p1 = p0;
+  while (drop < turns_.size())
+  {
+    drop++;
+    p1 = drop < turns_.size() ? turns_[drop].token : context_tokens_.size();
+    if (context_tokens_.size() - (p1 - p0) + tokens.size() + response_reserve_tokens_ <= max_context_tokens_)
+    {
+      break;
+    }
+  }
+
+  const size_t m0 = turns_[keep].message;
+  const size_t m1 = drop < turns_.size() ? turns_[drop].message : turn_message_;
+  const llama_pos shift = p1 - p0;
+
+  llama_kv_cache_seq_rm(ctx_, seq_id_, p0, p1);
+  llama_kv_cache_seq_add(ctx_, seq_id_, p1, -1, -shift);
+  SyncDraft(p0);
+  context_tokens_.erase(context_tokens_.begin() + p0, context_tokens_.begin() + p1);
+
+  messages_.erase(messages_.begin() + m0, messages_.begin() + m1);
+  turns_.erase(turns_.begin() + keep, turns_.begin() + drop);
+  for (size_t i = keep; i < turns_.size(); ++i)
+  {
+    turns_[i].token -= shift;
+    turns_[i].message -= m1 - m0;
+  }
+
+  // The history before the new turn, and any replayed turns, now renders shorter
+  turn_message_ -= m1 - m0;
+  std::vector<std::pair<std::string, std::string>> tail(messages_.begin() + turn_message_, messages_.end());
+  messages_.erase(messages_.begin() + turn_message_, messages_.end());
+  formatted_len_ = ApplyChatTemplate(false).size();
+  messages_.insert(messages_.end(), tail.begin(), tail.end());
+
+  const std::string formatted = ApplyChatTemplate(true);
+  if (formatted.size() <= formatted_len_ || !TokenizeTurn(formatted.substr(formatted_len_), tokens))
+  {
+    return false;
+  }
+
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  LOG_I("Context shifted by " << shift << " tokens, dropped " << m1 - m0 << " messages in " << ms << " ms");
+
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_.context_shifts++;
+  stats_.context_shift_ms = ms;
+  return true;
+}
+
+// Set up the turn's prefill, with the engine mutex held
+bool LlamaSimpleChat::PrepareTurn(const std::string &prompt)
+{
+  if (!session_started_ && !StartSession())
+  {
+    return false;
+  }
+
+  // Only the text the template added since the last turn gets prefilled
+  messages_.push_back(std::make_pair(std::string("user"), prompt));
+  turn_message_ = messages_.size() - 1 - replayed_messages_;
+  std::string formatted = ApplyChatTemplate(true);
+  std::vector<llama_token> tokens;
+  if (formatted.size() <= formatted_len_ ||
+      !TokenizeTurn(formatted.substr(formatted_len_), tokens) ||
+      !TrimContext(tokens) || tokens.empty())
+  {
+    messages_.pop_back();
+    return false;
+  }
+
+  pending_ = std::move(tokens);
+  pending_offset_ = 0;
+  scheduled_ = 0;
+  logits_index_ = -1;
+  draft_count_ = 0;
+  prefill_tokens_ = pending_.size();
+  prefill_start_ = std::chrono::steady_clock::now();
+  turn_start_ = context_tokens_.size();
+  decode_failed_ = false;
+
+  response_.clear();
+  current_phrase_.clear();
+  last_flush_ = prefill_start_;
+  generated_tokens_ = 0;
+  tokens_sampled_ = 0;
+  generation_steps_ = 0;
+  stop_engine_.reset();
+  stop_reason_ = LlamaStopReason::None;
+  turn_stop_ = WhillatsLlamaStopReason::EndOfGeneration;
+  sample_time_ = std::chrono::steady_clock::duration::zero();
+  samples_ = 0;
+  // A fixed seed restarts with every turn, so a dialogue replays exactly
+  llama_sampler_reset(smpl_);
+
+  std::lock_guard<std::mutex> lock(events_mutex_);
+  events_ = std::queue<LlamaChatEvent>();
+  turn_done_ = false;
+  return true;
+}
+
+int32_t LlamaSimpleChat::PendingTokens() const
+{
+  return pending_.size() - pending_offset_;
+}
+
+// Feed the next prefill chunk, or the last sampled token, at the positions
+// following what the sequence already holds
+int32_t LlamaSimpleChat::Schedule(llama_batch &batch, int32_t budget)
+{
+  // Drafts are verified together or not at all. Without room for all of
+  // them the step feeds just the sampled token, leaving nothing to verify.
+  if (draft_count_ > 0 && budget < PendingTokens())
+  {
+    pending_.resize(pending_offset_ + 1);
+    SyncDraft(context_tokens_.size());
+    draft_count_ = 0;
+  }
+
+  const int32_t n = std::min<int32_t>(budget, PendingTokens());
+  for (int32_t i = 0; i < n; ++i)
+  {
+    const size_t k = pending_offset_ + i;
+    const int32_t j = batch.n_tokens + i;
+    batch.token[j] = pending_[k];
+    batch.pos[j] = context_tokens_.size() + i;
+    batch.n_seq_id[j] = 1;
+    batch.seq_id[j][0] = seq_id_;
+    batch.logits[j] = draft_count_ > 0 || k + 1 == pending_.size();  // Only the last token is sampled from
+  }
+
+  if (draft_count_ > 0)
+  {
+    logits_index_ = batch.n_tokens;
+  }
+  else
+  {
+    logits_index_ = (n > 0 && pending_offset_ + n == pending_.size()) ? batch.n_tokens + n - 1 : -1;
+  }
+  batch.n_tokens += n;
+  scheduled_ = n;
+  return n;
+}
+
+bool LlamaSimpleChat::OnDecoded(llama_context *ctx, bool ok)
+{
+  if (!ok)
+  {
+    // Leave the sequence as it was before the failed step, or before the turn
+    // if its prompt never made it in
+    LOG_E("Failed to decode, " << context_tokens_.size() << " tokens in context");
+    decode_failed_ = true;
+    turn_stop_ = WhillatsLlamaStopReason::Error;
+    if (generated_tokens_ == 0)
+    {
+      context_tokens_.resize(turn_start_);
+    }
+    llama_kv_cache_seq_rm(ctx, seq_id_, context_tokens_.size(), -1);
+    SyncDraft(context_tokens_.size());
+    draft_count_ = 0;
+    FinishTurn();
+    return true;
+  }
+
+  // The decoded tokens are now part of the dialogue in the KV cache
+  context_tokens_.insert(context_tokens_.end(), pending_.begin() + pending_offset_,
+                         pending_.begin() + pending_offset_ + scheduled_);
+  pending_offset_ += scheduled_;
+  if (!continue_)
+  {
+    FinishTurn();
+    return true;
+  }
+  if (logits_index_ < 0)
+  {
+    return false;  // More prefill to go
+  }
+
+  if (generated_tokens_ == 0)
+  {
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - prefill_start_).count();
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.prefill_ms = ms;
+    stats_.prefill_tokens_per_s = ms > 0 ? prefill_tokens_ * 1000.0 / ms : 0;
+  }
+
+  if (!SampleNext(ctx))
+  {
+    FinishTurn();
+    return true;
+  }
+  return false;
+}
+
+// One token from the logits at index, timed for the stats. -1 when the step
+// has no logits there.
+llama_token LlamaSimpleChat::Sample(llama_context *ctx, int32_t index)
+{
+  auto start = std::chrono::steady_clock::now();
+  const float *logits = llama_get_logits_ith(ctx, index);
+  if (!logits)
+  {
+    LOG_E("No logits at batch index " << index << " to sample from");
+    return -1;
+  }
+  llama_token token;
+  if (sampler_config_.mode == WhillatsSamplerMode::Greedy)
+  {
+    // A plain argmax, skipping the candidate array the chain builds
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab_);
+    token = 0;
+    for (int32_t i = 1; i < n_vocab; ++i)
+    {
+      if (logits[i] > logits[token])
+      {
+        token = i;
+      }
+    }
+  }
+  else
+  {
+    token = llama_sampler_sample(smpl_, ctx, index);
+  }
+  sample_time_ += std::chrono::steady_clock::now() - start;
+  samples_++;
+  return token;
+}
+
+// Sample from the decoded step and queue the next one, false when the turn ends
+bool LlamaSimpleChat::SampleNext(llama_context *ctx)
+{
+  if (!continue_ || BudgetSpent())
+  {
+    return false;
+  }
+
+  // Sample next token. A step with draft tokens has logits for each of them,
+  // the target keeps drafts for as long as its own samples agree.
+  llama_token new_token_id = Sample(ctx, logits_index_);
+  size_t accepted = 0;
+  bool end = false;
+  while (accepted < draft_count_ && new_token_id == pending_[accepted + 1])
+  {
+    if (BudgetSpent() || !AcceptToken(new_token_id))
+    {
+      end = true;
+      break;
+    }
+    accepted++;
+    new_token_id = Sample(ctx, logits_index_ + accepted);
+  }
+
+  if (draft_count_ > 0)
+  {
+    // Rejected drafts leave the KV cache, the sample at the first of them
+    // replaces it
+    context_tokens_.resize(context_tokens_.size() - (draft_count_ - accepted));
+    llama_kv_cache_seq_rm(ctx, seq_id_, context_tokens_.size(), -1);
+    SyncDraft(context_tokens_.size());
+    generated_tokens_ += accepted;
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.draft_tokens += draft_count_;
+    stats_.draft_accepted += accepted;
+    stats_.draft_acceptance = (double)stats_.draft_accepted / stats_.draft_tokens;
+    draft_count_ = 0;
+  }
+
+  // Nothing to sample counts as a failed decode
+  if (!end && new_token_id < 0)
+  {
+    decode_failed_ = true;
+    turn_stop_ = WhillatsLlamaStopReason::Error;
+    return false;
+  }
+  if (end || !AcceptToken(new_token_id))
+  {
+    return false;
+  }
+  return QueueNext(new_token_id);
+}
+
+// Hand a new token to the response, false when it ends the turn
+bool LlamaSimpleChat::AcceptToken(llama_token token)
+{
+  // End of turn, not only end of text, or chat models run on into the next turn
+  const bool eog = llama_vocab_is_eog(vocab_, token);
+  std::string piece;
+  if (!eog && !TokenToPiece(token, piece))
+  {
+    return false;
+  }
+  stop_reason_ = stop_engine_.feed(eog, piece.data(), piece.size());
+  turn_stop_ = ToStopReason(stop_reason_);
+  if (stop_reason_ == LlamaStopReason::EndOfGeneration)
+  {
+    return false;
+  }
+
+  if (tokens_sampled_ == 0)
+  {
+    auto ttft = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - _lastResponseStart).count();
+    LOG_I("First token in " << ttft << " ms, prefilled " << prefill_tokens_ << " of "
+          << context_tokens_.size() << " context tokens");
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.turns++;
+    stats_.ttft_ms = ttft;
+    stats_.prefill_tokens = prefill_tokens_;
+  }
+
+  // A stop string is cut from the text, as far as it wasn't handed out yet
+  size_t trim = 0;
+  if (stop_reason_ == LlamaStopReason::StopString)
+  {
+    trim = std::min(stop_engine_.stopTrim(), current_phrase_.size() + piece.size());
+  }
+
+  // Process the generated piece
+  auto now = std::chrono::steady_clock::now();
+  if (stream_tokens_ && trim < piece.size())
+  {
+    LlamaChatEvent event;
+    event.is_token = true;
+    event.text = piece.substr(0, piece.size() - trim);
+    event.index = tokens_sampled_;
+    event.time_ms = std::chrono::duration<double, std::milli>(now - _lastResponseStart).count();
+    event.interval_ms = std::chrono::duration<double, std::milli>(
+        now - (tokens_sampled_ == 0 ? _lastResponseStart : last_token_time_)).count();
+    PushEvent(std::move(event));
+  }
+  if (tokens_sampled_ == 0)
+  {
+    first_token_time_ = now;
+  }
+  last_token_time_ = now;
+  tokens_sampled_++;
+  if (current_phrase_.empty())
+  {
+    segment_start_ = now;
+  }
+  current_phrase_ += piece;
+  current_phrase_.resize(current_phrase_.size() - trim);
+
+  // Stop strings, repetition and piling up filler end the response, and so
+  // does the next clause boundary once the budget is nearly spent
+  bool should_end = stop_reason_ != LlamaStopReason::None;
+  if (!should_end && piece.find_first_of(",;:.!?") != std::string::npos && WrappingUp(now))
+  {
+    should_end = true;
+  }
+
+  // Completed sentences always go out, filler words count per sentence
+  if (piece.find_first_of(".!?") != std::string::npos || should_end)
+  {
+    FlushSegment(current_phrase_.size(), now);
+    stop_engine_.resetPhrase();
+    return !should_end;
+  }
+
+  const size_t cut = SegmentCut(piece, now);
+  if (cut > 0)
+  {
+    FlushSegment(cut, now);
+  }
+  return true;
+}
+
+// Hard limits of the turn's budget, true once one is reached
+bool LlamaSimpleChat::BudgetSpent()
+{
+  if (budget_.max_tokens > 0 && tokens_sampled_ >= budget_.max_tokens)
+  {
+    turn_stop_ = WhillatsLlamaStopReason::TokenBudget;
+    return true;
+  }
+  if (budget_.max_time_ms > 0 &&
+      std::chrono::steady_clock::now() - _lastResponseStart >= std::chrono::milliseconds(budget_.max_time_ms))
+  {
+    turn_stop_ = WhillatsLlamaStopReason::TimeBudget;
+    return true;
+  }
+  return false;
+}
+
+// Whether the budget is close enough to end at a clause boundary, which then
+// is the reason the turn ends
+bool LlamaSimpleChat::WrappingUp(std::chrono::steady_clock::time_point now)
+{
+  if (budget_.max_tokens > 0 && tokens_sampled_ + budget_.wrap_up_tokens >= budget_.max_tokens)
+  {
+    turn_stop_ = WhillatsLlamaStopReason::TokenBudget;
+    return true;
+  }
+  if (budget_.max_time_ms > 0 &&
+      now - _lastResponseStart + std::chrono::milliseconds(budget_.wrap_up_ms) >=
+          std::chrono::milliseconds(budget_.max_time_ms))
+  {
+    turn_stop_ = WhillatsLlamaStopReason::TimeBudget;
+    return true;
+  }
+  return false;
+}
+
+// Where to cut the text held back mid sentence, 0 to keep holding it
+size_t LlamaSimpleChat::SegmentCut(const std::string &piece, std::chrono::steady_clock::time_point now) const
+{
+  const WhillatsSegmentConfig &config = segment_config_;
+  const size_t length = current_phrase_.size();
+  if (length < config.min_chars)
+  {
+    return 0;
+  }
+
+  if (config.clauses && (piece.find_first_of(",;:") != std::string::npos ||
+                         piece.find("\xe2\x80\x94") != std::string::npos ||   // Em dash
+                         piece == " -"))
+  {
+    return length;
+  }
+
+  // Over the limits, cut before the word still being generated
+  const bool too_long = config.max_chars > 0 && length >= config.max_chars;
+  const bool too_late = config.max_delay_ms > 0 &&
+                        now - last_flush_ >= std::chrono::milliseconds(config.max_delay_ms);
+  if (too_long || too_late)
+  {
+    const size_t space = current_phrase_.find_last_of(' ');
+    if (space != std::string::npos && space >= config.min_chars)
+    {
+      return space;
+    }
+    return too_long ? length : 0;
+  }
+  return 0;
+}
+
+// Hand the first length bytes of the held back text to the response callback
+void LlamaSimpleChat::FlushSegment(size_t length, std::chrono::steady_clock::time_point now)
+{
+  if (length > 0)
+  {
+    LlamaChatEvent phrase;
+    phrase.text = current_phrase_.substr(0, length);
+    PushEvent(std::move(phrase));
+
+    const double latency = std::chrono::duration<double, std::milli>(now - segment_start_).count();
+    LOG_V("Segment of " << length << " chars after " << latency << " ms");
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    const uint64_t n = ++stats_.segments;
+    stats_.segment_chars_avg += ((double)length - stats_.segment_chars_avg) / n;
+    stats_.segment_latency_ms = latency;
+    stats_.segment_latency_avg_ms += (latency - stats_.segment_latency_avg_ms) / n;
+    stats_.segment_latency_max_ms = std::max(stats_.segment_latency_max_ms, latency);
+  }
+  response_ += current_phrase_.substr(0, length);
+  current_phrase_.erase(0, length);
+  segment_start_ = now;
+  last_flush_ = now;
+}
+
+// Token text, pieces longer than the stack buffer are rendered again
+bool LlamaSimpleChat::TokenToPiece(llama_token token, std::string &piece) const
+{
+  char buffer[64];
+  int n = llama_token_to_piece(vocab_, token, buffer, sizeof(buffer), 0, true);
+  if (n >= 0)
+  {
+    piece.assign(buffer, n);
+    return true;
+  }
+
+  piece.resize(-n);
+  n = llama_token_to_piece(vocab_, token, &piece[0], piece.size(), 0, true);
+  if (n < 0)
+  {
+    return false;
+  }
+  piece.resize(n);
+  return true;
+}
+
+// Make the token, and any drafts following it, the next step's input
+bool LlamaSimpleChat::QueueNext(llama_token token)
+{
+  if (context_tokens_.size() + 1 >= max_context_tokens_)
+  {
+    turn_stop_ = WhillatsLlamaStopReason::ContextFull;
+    return false;
+  }
+
+  // Prepare next token
+  pending_.assign(1, token);
+  pending_offset_ = 0;
+  generated_tokens_++;
+  generation_steps_++;
+
+  // Drafts and the token have to fit one batch to be verified together
+  const int32_t room = std::min<int32_t>(std::min<int32_t>(kDraftTokens, (int32_t)config_.n_batch - 1),
+                                         (int32_t)max_context_tokens_ - (int32_t)context_tokens_.size() - 2);
+  if (speculative_mode_ == WhillatsSpeculativeMode::DraftModel && draft_engine_ && room > 0)
+  {
+    DraftTokens(token, room);
+  }
+  else if (speculative_mode_ == WhillatsSpeculativeMode::PromptLookup && room > 0)
+  {
+    LookupTokens(token, room);
+  }
+  return true;
+}
+
+// Let the draft model continue the dialogue greedily from token. The draft
+// sequence catches up on what the target decoded since the last round first.
+void LlamaSimpleChat::DraftTokens(llama_token token, int32_t max_tokens)
+{
+  std::lock_guard<std::mutex> lock(draft_engine_->mutex());
+  llama_context *draft_ctx = draft_engine_->context();
+
+  std::vector<llama_token> feed(context_tokens_.begin() + draft_past_, context_tokens_.end());
+  feed.push_back(token);
+  for (int32_t i = 0; i < max_tokens; ++i)
+  {
+    if (!draft_engine_->DecodeSequence(feed, draft_seq_, draft_past_, true))
+    {
+      LOG_W("Draft decode failed, restarting the draft sequence");
+      llama_kv_cache_seq_rm(draft_ctx, draft_seq_, -1, -1);
+      draft_past_ = 0;
+      break;
+    }
+    draft_past_ += feed.size();
+
+    llama_token draft = llama_sampler_sample(draft_smpl_, draft_ctx, -1);
+    if (llama_vocab_is_eog(draft_engine_->vocab(), draft))
+    {
+      break;
+    }
+    pending_.push_back(draft);
+    draft_count_++;
+    feed.assign(1, draft);
+  }
+}
+
+// Draft without a model: find the latest earlier occurrence of the dialogue's
+// last few tokens, token included, and propose what followed it. Longer
+// matches are tried first, answers often echo the prompt or earlier turns.
+void LlamaSimpleChat::LookupTokens(llama_token token, int32_t max_tokens)
+{
+  const std::vector<llama_token> &history = context_tokens_;
+  const size_t size = history.size() + 1;   // With token at the end
+  auto at = [&](size_t i) { return i < history.size() ? history[i] : token; };
+
+  for (size_t n = std::min(kLookupMaxNgram, size - 1); n >= kLookupMinNgram; --n)
+  {
+    // Candidate starts, latest first, with at least one token after the match
+    for (size_t start = size - n; start-- > 0;)
+    {
+      size_t k = 0;
+      while (k < n && at(start + k) == at(size - n + k))
+      {
+        k++;
+      }
+      if (k < n || start + n >= size - 1)
+      {
+        continue;
+      }
+
+      for (size_t i = start + n; i < size - 1 && draft_count_ < (size_t)max_tokens; ++i)
+      {
+        pending_.push_back(at(i));
+        draft_count_++;
+      }
+      return;
+    }
+  }
+}
+
+// Drop what the draft sequence holds past the first keep dialogue tokens
+void LlamaSimpleChat::SyncDraft(size_t keep)
+{
+  if (!draft_engine_ || draft_past_ <= keep)
+  {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(draft_engine_->mutex());
+  draft_past_ = keep;
+  llama_kv_cache_seq_rm(draft_engine_->context(), draft_seq_, draft_past_, -1);
+}
+
+void LlamaSimpleChat::PushEvent(LlamaChatEvent event)
+{
+  std::lock_guard<std::mutex> lock(events_mutex_);
+  events_.push(std::move(event));
+  events_condition_.notify_one();
+}
+
+// Forget a cancelled turn: the prompt and whatever was answered leave the
+// dialogue and the KV cache, the next turn continues from the last one
+void LlamaSimpleChat::RollbackTurn()
+{
+  {
+    std::lock_guard<std::mutex> lock(engine_->mutex());
+    context_tokens_.resize(std::min(context_tokens_.size(), turn_start_));
+    llama_kv_cache_seq_rm(ctx_, seq_id_, context_tokens_.size(), -1);
+    SyncDraft(context_tokens_.size());
+  }
+  messages_.pop_back();
+  LOG_I("Turn cancelled after " << tokens_sampled_ << " tokens, " << context_tokens_.size() << " tokens in context");
+
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_.cancellations++;
+}
+
+// Hand any remaining text over and wake up generate()
+void LlamaSimpleChat::FinishTurn()
+{
+  if (tokens_sampled_ > 1)
+  {
+    // The first token carries the prefill, it is in ttft_ms instead
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.inter_token_ms = std::chrono::duration<double, std::milli>(
+        last_token_time_ - first_token_time_).count() / (tokens_sampled_ - 1);
+  }
+  if (generation_steps_ > 0)
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.tokens_per_step = (double)tokens_sampled_ / generation_steps_;
+  }
+  if (samples_ > 0)
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.sample_us = std::chrono::duration<double, std::micro>(sample_time_).count() / samples_;
+    stats_.sample_us_avg += (stats_.sample_us - stats_.sample_us_avg) / ++sampled_turns_;
+  }
+  if (!continue_)
+  {
+    turn_stop_ = WhillatsLlamaStopReason::Cancelled;
+  }
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.stop_reason = turn_stop_;
+    if (turn_stop_ == WhillatsLlamaStopReason::TokenBudget || turn_stop_ == WhillatsLlamaStopReason::TimeBudget)
+    {
+      stats_.budget_stops++;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(events_mutex_);
+  if (!current_phrase_.empty())
+  {
+    LlamaChatEvent phrase;
+    phrase.text = current_phrase_;
+    events_.push(std::move(phrase));
+    response_ += current_phrase_;
+    current_phrase_.clear();
+  }
+  turn_done_ = true;
+  events_condition_.notify_one();
+}
+
+std::string LlamaSimpleChat::generate(const std::string &prompt, WhillatsSetResponseCallback callback,
+                                      WhillatsSetTokenCallback token_callback, WhillatsSetDoneCallback done_callback)
+{
+  if (!engine_ || seq_id_ < 0)
+  {
+    done_callback.OnDone(WhillatsLlamaStopReason::Error, "");
+    return "";
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(engine_->mutex());
+    if (!PrepareTurn(prompt))
+    {
+      LOG_E("Failed to process prompt");
+      done_callback.OnDone(WhillatsLlamaStopReason::Error, "");
+      return "";
+    }
+    stream_tokens_ = token_callback.enabled() || record_turn_;
+  }
+  last_turn_ = LlamaCachedResponse();
+  engine_->Submit(this);
+
+  // Output is delivered here, so callbacks never run on the engine thread
+  while (true)
+  {
+    LlamaChatEvent event;
+    {
+      std::unique_lock<std::mutex> lock(events_mutex_);
+      events_condition_.wait(lock, [this] { return !events_.empty() || turn_done_; });
+      if (events_.empty())
+      {
+        break;
+      }
+      event = std::move(events_.front());
+      events_.pop();
+    }
+
+    if (!continue_)
+    {
+      continue;  // Cancelled, what's left is stale
+    }
+
+    if (event.is_token)
+    {
+      WhillatsLlamaToken token = {event.text.c_str(), event.index, event.time_ms, event.interval_ms};
+      token_callback.OnToken(token);
+      if (record_turn_)
+      {
+        last_turn_.tokens.push_back(event.text);
+      }
+      continue;
+    }
+
+    callback.OnResponseComplete(true, event.text.c_str());
+    if (record_turn_)
+    {
+      last_turn_.phrases.push_back(event.text);
+    }
+
+    _lastResponseEnd = std::chrono::steady_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+            _lastResponseEnd - _lastResponseStart).count();
+    std::cout << "Llama says: '" << event.text << "' in " << duration << " ms" << std::endl;
+  }
+
+  if (!continue_)
+  {
+    RollbackTurn();
+    done_callback.OnDone(WhillatsLlamaStopReason::Cancelled, "");
+    return "";
+  }
+
+  // A prompt that never got decoded is not part of the dialogue
+  if (decode_failed_ && generated_tokens_ == 0 && response_.empty())
+  {
+    messages_.pop_back();
+    done_callback.OnDone(WhillatsLlamaStopReason::Error, "");
+    return "";
+  }
+
+  // Commit the turn. The template's rendering of the answer now matches the
+  // KV cache, so the next turn starts prefilling right after it.
+  LlamaTurnSpan span;
+  span.message = turn_message_;
+  span.token = turn_start_;
+  turns_.push_back(span);
+  messages_.push_back(std::make_pair(std::string("assistant"), response_));
+  formatted_len_ = ApplyChatTemplate(false).size();
+  replayed_messages_ = 0;
+  last_turn_.response = response_;
+  LOG_V("Turn ended by " << static_cast<int>(turn_stop_) << " after " << tokens_sampled_ << " tokens");
+  done_callback.OnDone(turn_stop_, response_.c_str());
+
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_.context_tokens = context_tokens_.size();
+
+  return response_;
+}
+
+//
+// Llama device base
+//
+
+LlamaDeviceBase::LlamaDeviceBase(
+    const char*model_path,
+    WhillatsSetResponseCallback callback)
+    : _running(false),
+      _model_path(model_path),
+      _responseCallback(callback)
+{
+}
 
-    if (_processingThread.joinable())
+LlamaDeviceBase::~LlamaDeviceBase()
+{
+  if (_swapThread.joinable())
+  {
+    _swapThread.join();
+  }
+}
+
+void LlamaDeviceBase::askLlama(const char* prompt, int priority, uint32_t deadline_ms,
+                               const WhillatsLlamaBudget& budget)
+{
+  if (!prompt || !*prompt)
+  {
+    return;
+  }
+
+  LlamaRequest request;
+  request.prompt = prompt;
+  request.priority = priority;
+  request.enqueued = std::chrono::steady_clock::now();
+  request.has_deadline = deadline_ms > 0;
+  request.deadline = request.enqueued + std::chrono::milliseconds(deadline_ms);
+  request.budget = budget;
+  {
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    request.order = _requestOrder++;
+    _requests.push(std::move(request));
+  }
+  _queueCondition.notify_one();
+}
+
+void LlamaDeviceBase::cancel()
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  LlamaRequestQueue().swap(_requests);
+  _cancels++;
+  if (_activeChat)
+  {
+    _activeChat->StopGeneration();
+  }
+}
+
+void LlamaDeviceBase::replace(const char* prompt)
+{
+  cancel();
+  askLlama(prompt);
+}
+
+void LlamaDeviceBase::setResponseCache(size_t max_bytes, uint32_t ttl_ms)
+{
+  _responseCache.configure(max_bytes, ttl_ms);
+}
+
+bool LlamaDeviceBase::saveSession(const char* path)
+{
+  if (!_running || !path)
+  {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(_sessionMutex);
+  return _chats[LastChat()]->SaveSession(path);
+}
+
+bool LlamaDeviceBase::loadSession(const char* path)
+{
+  if (!_running || !path)
+  {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(_sessionMutex);
+  {
+    // The loaded dialogue replaces any reset still pending
+    std::unique_lock<std::mutex> queueLock(_queueMutex);
+    _sessionReset = false;
+  }
+
+  // Into the chat whose model saved it, the others follow its dialogue
+  for (size_t i = 0; i < _chats.size(); ++i)
+  {
+    if (_chats[i]->LoadSession(path))
     {
-      _processingThread.join();
+      for (size_t j = 0; j < _chats.size(); ++j)
+      {
+        if (j != i)
+        {
+          _chats[j]->AdoptDialogue(_chats[i]->Messages());
+        }
+      }
+      std::unique_lock<std::mutex> queueLock(_queueMutex);
+      _lastChat = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t LlamaDeviceBase::LastChat() const
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  return _lastChat;
+}
+
+int LlamaDeviceBase::addModel(const char* model_path, uint32_t max_prompt_chars)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  if (!model_path || !*model_path)
+  {
+    return -1;
+  }
+  _extraModels.push_back(std::make_pair(std::string(model_path), max_prompt_chars));
+  return _extraModels.size();
+}
+
+void LlamaDeviceBase::addRoutingKeyword(const char* keyword, int model)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  if (keyword)
+  {
+    _routingKeywords.push_back(std::make_pair(std::string(keyword), model));
+  }
+}
+
+void LlamaDeviceBase::setRouterModel(const char* model_path)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _routerModelPath = model_path ? model_path : "";
+}
+
+void LlamaDeviceBase::addRouterLabel(const char* label, int model)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  if (label && *label && model >= 0)
+  {
+    _routerLabels.push_back(std::make_pair(std::string(label), model));
+  }
+}
+
+std::vector<WhillatsLlamaModelStats> LlamaDeviceBase::getModelStats() const
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  return _modelStats;
+}
+
+void LlamaDeviceBase::setConfig(const WhillatsLlamaConfig& config)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _config = config;
+}
+
+void LlamaDeviceBase::setTokenCallback(WhillatsSetTokenCallback callback)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _tokenCallback = callback;
+}
+
+void LlamaDeviceBase::setDoneCallback(WhillatsSetDoneCallback callback)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _doneCallback = callback;
+}
+
+void LlamaDeviceBase::setDraftModel(const char* model_path)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _draftModelPath = model_path ? model_path : "";
+  if (!_draftModelPath.empty())
+  {
+    _speculativeMode = WhillatsSpeculativeMode::DraftModel;
+  }
+}
+
+void LlamaDeviceBase::setSpeculativeMode(WhillatsSpeculativeMode mode)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _speculativeMode = mode;
+}
+
+void LlamaDeviceBase::setSegmentation(const WhillatsSegmentConfig& config)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _segmentConfig = config;
+}
+
+void LlamaDeviceBase::setSampler(const WhillatsSamplerConfig& config)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _samplerConfig = config;
+}
+
+void LlamaDeviceBase::setStopStrings(const std::vector<std::string>& stops)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _stopStrings = stops;
+  _stopStringsChanged = true;
+}
+
+void LlamaDeviceBase::setSystemPrompt(const char* prompt)
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _systemPrompt = prompt ? prompt : "";
+  _sessionReset = true;
+}
+
+void LlamaDeviceBase::resetConversation()
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _sessionReset = true;
+}
+
+WhillatsLlamaStats LlamaDeviceBase::getStats() const
+{
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  WhillatsLlamaStats stats = _lastChat < _chats.size() ? _chats[_lastChat]->GetStats() : WhillatsLlamaStats();
+  stats.queue_depth = _requests.size();
+  stats.queue_wait_ms = _queueStats.queue_wait_ms;
+  stats.queue_wait_avg_ms = _queueStats.queue_wait_avg_ms;
+  stats.queue_wait_max_ms = _queueStats.queue_wait_max_ms;
+  stats.requests_expired = _queueStats.requests_expired;
+  stats.model_swaps = _queueStats.model_swaps;
+  stats.model_swap_ms = _queueStats.model_swap_ms;
+  stats.model_swap_peak_bytes = _queueStats.model_swap_peak_bytes;
+  stats.route_model = _queueStats.route_model;
+  stats.route_ms = _queueStats.route_ms;
+  stats.routed_turns = _queueStats.routed_turns;
+  lock.unlock();
+
+  stats.cache_hits = _responseCache.hits();
+  stats.cache_misses = _responseCache.misses();
+  stats.cache_evictions = _responseCache.evictions();
+  stats.cache_entries = _responseCache.entries();
+  stats.cache_bytes = _responseCache.bytes();
+  return stats;
+}
+
+// Sleeps until a request arrives, then answers the most urgent one. Settings
+// changed in the meantime apply before it.
+bool LlamaDeviceBase::RunProcessingThread()
+{
+
+  while (_running)
+  {
+    LlamaRequest request;
+    uint64_t cancels = 0;
+    bool expired = false;
+    bool resetSession = false;
+    std::string systemPrompt;
+    WhillatsSetTokenCallback tokenCallback;
+    WhillatsSetDoneCallback doneCallback;
+    WhillatsSpeculativeMode speculativeMode;
+    WhillatsSamplerConfig samplerConfig;
+    WhillatsSegmentConfig segmentConfig;
+    std::vector<std::string> stopStrings;
+    bool stopStringsChanged = false;
+
+    {
+      std::unique_lock<std::mutex> lock(_queueMutex);
+      _queueCondition.wait(lock, [this] { return !_running || !_requests.empty(); });
+      if (!_running)
+      {
+        break;
+      }
+
+      request = _requests.top();
+      _requests.pop();
+      cancels = _cancels;
+      auto now = std::chrono::steady_clock::now();
+      const double wait_ms = std::chrono::duration<double, std::milli>(now - request.enqueued).count();
+      expired = request.has_deadline && now > request.deadline;
+      if (expired)
+      {
+        _queueStats.requests_expired++;
+      }
+      else
+      {
+        _queueStats.queue_wait_ms = wait_ms;
+        _queueStats.queue_wait_max_ms = std::max(_queueStats.queue_wait_max_ms, wait_ms);
+        _queueStats.queue_wait_avg_ms += (wait_ms - _queueStats.queue_wait_avg_ms) / ++_requestsServed;
+      }
+
+      resetSession = _sessionReset;
+      systemPrompt = _systemPrompt;
+      _sessionReset = false;
+      tokenCallback = _tokenCallback;
+      doneCallback = _doneCallback;
+      speculativeMode = _speculativeMode;
+      segmentConfig = _segmentConfig;
+      samplerConfig = _samplerConfig;
+      stopStringsChanged = _stopStringsChanged;
+      _stopStringsChanged = false;
+      if (stopStringsChanged)
+      {
+        stopStrings = _stopStrings;
+      }
+    }
+
+    if (expired)
+    {
+      LOG_W("Dropped '" << request.prompt << "', its deadline passed in the queue");
+      _responseCallback.OnResponseComplete(false, "");
+      doneCallback.OnDone(WhillatsLlamaStopReason::Expired, "");
+      continue;
+    }
+    std::cout << "Asked: '" << request.prompt << "'" << std::endl;
+
+    std::unique_lock<std::mutex> sessionLock(_sessionMutex);
+    for (auto& chat : _chats)
+    {
+      if (resetSession)
+      {
+        chat->SetSystemPrompt(systemPrompt);
+        chat->ResetSession();
+      }
+      if (stopStringsChanged)
+      {
+        chat->SetStopStrings(stopStrings);
+      }
+      chat->SetSpeculativeMode(speculativeMode);
+      chat->SetSegmentation(segmentConfig);
+      chat->SetSampler(samplerConfig);
+    }
+
+    // Pick the model, then answer from the cache or generate
+    auto routeStart = std::chrono::steady_clock::now();
+    LlamaRouteReason reason = LlamaRouteReason::Default;
+    int route = _router.Route(request.prompt, reason);
+    if (route < 0 || route >= (int)_chats.size())
+    {
+      route = 0;
+    }
+    const double routeMs = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - routeStart).count();
+    LlamaSimpleChat* chat = _chats[route].get();
+    if (_chats.size() > 1)
+    {
+      LOG_V("Routed to model " << route << " by " << static_cast<int>(reason) << " in " << routeMs << " ms");
+    }
+    {
+      std::unique_lock<std::mutex> lock(_queueMutex);
+      _activeChat = chat;
+      _lastChat = route;
+      chat->continue_ = cancels == _cancels;  // Unless cancelled while routing
+      _queueStats.route_model = route;
+      _queueStats.route_ms = routeMs;
+      _queueStats.routed_turns += route != 0;
+    }
+
+    chat->SetBudget(request.budget);
+    chat->_lastResponseStart = std::chrono::steady_clock::now();
+    const bool useCache = _responseCache.enabled();
+    chat->SetRecordTurn(useCache);
+    std::string cacheKey;
+    std::string response;
+    LlamaCachedResponse cached;
+    if (useCache)
+    {
+      cacheKey = chat->ResponseCacheKey(request.prompt);
+    }
+    if (useCache && _responseCache.find(cacheKey, cached))
+    {
+      chat->ReplayTurn(request.prompt, cached, _responseCallback, tokenCallback, doneCallback);
+      response = cached.response;
+    }
+    else
+    {
+      response = chat->generate(request.prompt, _responseCallback, tokenCallback, doneCallback);
+      // Only answers the model finished on its own terms, a budget, a
+      // repetition cut or a failed decode would replay to requests without them
+      const WhillatsLlamaStopReason stop = chat->TurnStop();
+      const bool complete = stop == WhillatsLlamaStopReason::EndOfGeneration ||
+                            stop == WhillatsLlamaStopReason::StopString;
+      if (!response.empty() && useCache && complete)
+      {
+        _responseCache.insert(cacheKey, chat->LastTurn());
+      }
+    }
+
+    // The other models keep the same dialogue
+    if (!response.empty())
+    {
+      for (auto& other : _chats)
+      {
+        if (other.get() != chat)
+        {
+          other->AppendTurn(request.prompt, response);
+        }
+      }
+    }
+    const WhillatsLlamaStats chatStats = chat->GetStats();
+    sessionLock.unlock();
+
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    _activeChat = nullptr;
+    if (!response.empty())
+    {
+      WhillatsLlamaModelStats& model = _modelStats[route];
+      model.turns++;
+      model.ttft_ms = chatStats.ttft_ms;
+      model.ttft_avg_ms += (chatStats.ttft_ms - model.ttft_avg_ms) / model.turns;
+      model.inter_token_ms = chatStats.inter_token_ms;
     }
   }
+
+  return true;
 }
 
-bool LlamaDeviceBase::TrimContext()
+bool LlamaDeviceBase::swapModel(const char* model_path, int model)
 {
-  if (context_tokens_.size() > max_context_tokens_)
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  if (!_running || _swapping || !model_path || !*model_path || model < 0 || model >= (int)_chats.size())
   {
-    // Keep the most recent tokens within the limit
-    size_t excess = context_tokens_.size() - max_context_tokens_;
-    context_tokens_.erase(context_tokens_.begin(), context_tokens_.begin() + excess);
+    return false;
+  }
+  _swapping = true;
+  lock.unlock();
 
-    // Reinitialize context with trimmed tokens
-    return _llama_chat->InitializeContext();
+  if (_swapThread.joinable())
+  {
+    _swapThread.join();
   }
+  const std::string path = model_path;
+  const auto start = std::chrono::steady_clock::now();
+  _swapThread = std::thread([this, path, model, start] { SwapModel(path, model, start); });
   return true;
 }
 
-bool LlamaDeviceBase::AppendToContext(const std::vector<llama_token> &new_tokens)
+// Runs on _swapThread. The load happens with the session still answering,
+// the switch waits for the turn in progress, if any, and costs a prefill of
+// the dialogue on the new model at the next prompt.
+void LlamaDeviceBase::SwapModel(const std::string& model_path, int model, std::chrono::steady_clock::time_point start)
+{
+  PeakMemorySampler memory;
+  std::string currentPath;
+  int ngl;
+  WhillatsLlamaConfig config;
+  {
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    const LlamaSimpleChat* current = _chats[model].get();
+    currentPath = current->model_path_;
+    ngl = current->ngl_;
+    config = current->config_;
+  }
+  std::shared_ptr<LlamaEngine> engine = LlamaEngine::Replace(currentPath, model_path, ngl, config);
+
+  std::unique_lock<std::mutex> sessionLock(_sessionMutex);
+  std::unique_ptr<LlamaSimpleChat> chat;
+  if (engine)
+  {
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    chat.reset(new LlamaSimpleChat());
+    chat->SetModelPath(model_path);
+    chat->SetSystemPrompt(_systemPrompt);
+    if (model == 0)
+    {
+      chat->SetDraftModelPath(_draftModelPath);
+    }
+    chat->SetConfig(config);
+    chat->SetSegmentation(_segmentConfig);
+    chat->SetSampler(_samplerConfig);
+    chat->SetStopStrings(_stopStrings);
+    chat->SetSpeculativeMode(_speculativeMode);
+    if (!_running)
+    {
+      chat.reset();
+    }
+  }
+  if (chat && chat->Initialize())
+  {
+    chat->AdoptDialogue(_chats[model]->Messages());
+  }
+  else if (chat)
+  {
+    LOG_E("Failed to initialize Llama chat for " << model_path << ", keeping " << currentPath);
+    chat.reset();
+  }
+  if (!chat)
+  {
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    _swapping = false;
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    if (model == 0)
+    {
+      _model_path = model_path;
+    }
+    else
+    {
+      _extraModels[model - 1].first = model_path;
+    }
+    _modelStats[model] = WhillatsLlamaModelStats();
+    _modelStats[model].model_path = model_path;
+    _chats[model].swap(chat);
+  }
+
+  // The old chat lets go of its sequence, and of the old model unless other
+  // sessions still use it
+  chat.reset();
+  sessionLock.unlock();
+  const uint64_t peakBytes = memory.stop();
+
+  std::unique_lock<std::mutex> lock(_queueMutex);
+  _swapping = false;
+  _queueStats.model_swaps++;
+  _queueStats.model_swap_ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+  _queueStats.model_swap_peak_bytes = peakBytes;
+  LOG_I("Model " << model << " swapped to " << model_path << " in " << _queueStats.model_swap_ms
+        << " ms, peak resident " << peakBytes / (1024 * 1024) << " MiB");
+}
+
+bool LlamaDeviceBase::start()
+{
+  if (!_running)
+  {
+    std::vector<std::pair<std::string, uint32_t>> models;
+    std::vector<std::pair<std::string, int>> keywords;
+    std::string routerModelPath;
+    std::vector<std::pair<std::string, int>> routerLabels;
+    WhillatsLlamaConfig config;
+    {
+      std::unique_lock<std::mutex> lock(_queueMutex);
+      models.push_back(std::make_pair(_model_path, 0u));
+      models.insert(models.end(), _extraModels.begin(), _extraModels.end());
+      keywords = _routingKeywords;
+      routerModelPath = _routerModelPath;
+      routerLabels = _routerLabels;
+      config = _config;
+
+      _chats.clear();
+      _modelStats.assign(models.size(), WhillatsLlamaModelStats());
+      _lastChat = 0;
+      for (size_t i = 0; i < models.size(); ++i)
+      {
+        std::unique_ptr<LlamaSimpleChat> chat(new LlamaSimpleChat());
+        chat->SetModelPath(models[i].first);
+        chat->SetSystemPrompt(_systemPrompt);
+        if (i == 0)
+        {
+          chat->SetDraftModelPath(_draftModelPath);
+        }
+        chat->SetConfig(_config);
+        chat->SetSegmentation(_segmentConfig);
+        chat->SetSampler(_samplerConfig);
+        chat->SetStopStrings(_stopStrings);
+        _modelStats[i].model_path = models[i].first;
+        _chats.push_back(std::move(chat));
+      }
+      _stopStringsChanged = false;
+      _sessionReset = false;
+    }
+
+    for (auto& chat : _chats)
+    {
+      if (!chat->Initialize())
+      {
+        LOG_E("Failed to initialize Llama chat for " << chat->model_path_);
+        _chats.clear();
+        return false;
+      }
+    }
+    LOG_V("Llama chat initialized!");
+
+    _router.Clear();
+    for (size_t i = 1; i < models.size(); ++i)
+    {
+      if (models[i].second > 0)
+      {
+        _router.AddLengthRule(models[i].second, i);
+      }
+    }
+    for (const auto& keyword : keywords)
+    {
+      _router.AddKeyword(keyword.first, keyword.second);
+    }
+    if (routerLabels.empty())
+    {
+      routerLabels.push_back(std::make_pair(std::string("simple"), 1));
+      routerLabels.push_back(std::make_pair(std::string("complex"), 0));
+    }
+    if (!routerModelPath.empty() && models.size() > 1 &&
+        !_router.LoadClassifier(routerModelPath, _chats[0]->ngl_, config, routerLabels))
+    {
+      LOG_W("Router model unavailable, routing by keywords and length only");
+    }
+
+    _running = true;
+    _processingThread = std::thread([this] {
+      while (_running && RunProcessingThread()) {
+      } 
+    });
+  }
+
+  return _running;
+}
+
+void LlamaDeviceBase::stop()
 {
-  context_tokens_.insert(context_tokens_.end(), new_tokens.begin(), new_tokens.end());
-  return TrimContext();
+  if (_running)
+  {
+    {
+      std::unique_lock<std::mutex> lock(_queueMutex);
+      _running = false;
+    }
+    _queueCondition.notify_all();
+
+    if (_processingThread.joinable())
+    {
+      _processingThread.join();
+    }
+
+    if (_swapThread.joinable())
+    {
+      _swapThread.join();
+    }
+
+    // Drops this session's references to the shared models
+    _router.FreeClassifier();
+    _chats.clear();
+  }
 }
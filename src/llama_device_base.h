@@ -24,15 +24,43 @@
 
 #include "whisper_helpers.h"
 
-struct llama_model;
-struct llama_context;
+#include "llama_engine.h"
+#include "llama_stop_engine.h"
+#include "llama_response_cache.h"
+#include "llama_router.h"
+
 struct llama_sampler;
-struct llama_vocab;
-typedef int32_t llama_token;
 
 #include "whillats.h"
 
-class LlamaSimpleChat {
+// Prefilled system prompt, resident in its own sequence of the shared engine
+// and copied into every chat that uses the same model and prompt
+struct LlamaPrefixSnapshot {
+  std::vector<llama_token> tokens;
+  size_t formatted_len = 0;          // Templated length of the system message
+  double prefill_ms = 0;             // What decoding the prefix cost once
+};
+
+// Where a committed turn's prefill and answer start in the dialogue. Usually
+// one user/assistant exchange, after a rebuild the first span can hold more.
+struct LlamaTurnSpan {
+  size_t message = 0;                // First message it covers
+  size_t token = 0;                  // First token in the KV cache
+};
+
+// Output of a turn in flight, handed from the engine thread to generate()
+struct LlamaChatEvent {
+  bool is_token = false;             // A streamed token, otherwise a completed phrase
+  std::string text;
+  uint32_t index = 0;
+  double time_ms = 0;
+  double interval_ms = 0;
+};
+
+// One conversation. The model and context belong to the LlamaEngine shared by
+// all chats on the same model, the chat owns a KV sequence in it and is fed
+// to the engine's decode loop as a job for each turn.
+class LlamaSimpleChat : public LlamaEngineJob {
 public:
   LlamaSimpleChat();
   ~LlamaSimpleChat();
@@ -40,35 +68,197 @@ public:
   bool SetModelPath(const std::string& path);
   bool SetNGL(int layers);
   bool SetContextSize(int size);
+  void SetConfig(const WhillatsLlamaConfig& config);
   void StopGeneration();
 
   bool Initialize();
-  std::string generate(const std::string& request, WhillatsSetResponseCallback callback);
+  std::string generate(const std::string& request, WhillatsSetResponseCallback callback,
+                       WhillatsSetTokenCallback token_callback = WhillatsSetTokenCallback(),
+                       WhillatsSetDoneCallback done_callback = WhillatsSetDoneCallback());
 
   bool InitializeContext();
   void FreeContext();
 
   bool LoadModel();
 
+  // Conversation state. The dialogue lives in the KV cache, each turn only
+  // prefills the tokens the chat template added since the previous one.
+  // A new session starts from the system prompt's resident prefix.
+  void ResetSession();
+  void SetSystemPrompt(const std::string& prompt);
+
+  // Dialogue and KV sequence to and from a file, between turns only. A
+  // session loads into an engine with the same model fingerprint.
+  bool SaveSession(const std::string& path);
+  bool LoadSession(const std::string& path);
+
+  // Extra strings that end a response, on top of the model's end of generation
+  void SetStopStrings(const std::vector<std::string>& stops);
+
+  // Response cache support. The key covers the normalized prompt, the
+  // dialogue before it and the settings that shape the answer. A replayed
+  // turn joins the dialogue like a generated one, its text is prefilled
+  // with the next turn.
+  std::string ResponseCacheKey(const std::string& prompt) const;
+  void ReplayTurn(const std::string& prompt, const LlamaCachedResponse& cached,
+                  WhillatsSetResponseCallback callback, WhillatsSetTokenCallback token_callback,
+                  WhillatsSetDoneCallback done_callback);
+  void SetRecordTurn(bool record) { record_turn_ = record; }
+
+  // Keeping several chats on one dialogue, for model routing
+  void AppendTurn(const std::string& prompt, const std::string& response);
+  void AdoptDialogue(const std::vector<std::pair<std::string, std::string>>& messages);
+  const std::vector<std::pair<std::string, std::string>>& Messages() const { return messages_; }
+  const LlamaCachedResponse& LastTurn() const { return last_turn_; }
+
+  // Speculative decoding, the draft model is loaded by Initialize()
+  void SetDraftModelPath(const std::string& path);
+  void SetSpeculativeMode(WhillatsSpeculativeMode mode);
+  void SetSegmentation(const WhillatsSegmentConfig& config) { segment_config_ = config; }
+  // Rebuilds the sampler chain when the settings change
+  void SetSampler(const WhillatsSamplerConfig& config);
+  // Limits for the next turn
+  void SetBudget(const WhillatsLlamaBudget& budget) { budget_ = budget; }
+  // Why the last turn ended
+  WhillatsLlamaStopReason TurnStop() const { return turn_stop_; }
+  WhillatsLlamaStats GetStats() const;
+
+  // LlamaEngineJob
+  int32_t PendingTokens() const override;
+  int32_t Schedule(llama_batch& batch, int32_t budget) override;
+  bool OnDecoded(llama_context* ctx, bool ok) override;
+
   std::string model_path_;
   int ngl_ = 99; // Number of GPU layers to offload
-  int n_predict_ = 2048; // Number of tokens to predict
-  std::string prompt_;
+  WhillatsLlamaConfig config_;
 
+  // Owned by engine_
   llama_model* model_ = nullptr;
   const llama_vocab* vocab_ = nullptr;
   llama_context* ctx_ = nullptr;
   llama_sampler* smpl_ = nullptr;
   
-  std::atomic<bool> continue_ = true;
-
-  bool isRepetitive(const std::string& text, size_t minPatternLength = 4);
-  bool hasConfirmationPattern(const std::string& text);
+  std::atomic<bool> continue_{true};          // Cleared to cancel the turn in progress
 
   std::chrono::steady_clock::time_point _lastResponseStart;
   std::chrono::steady_clock::time_point _lastResponseEnd;
+
+private:
+  std::string ApplyChatTemplate(bool add_assistant) const;
+  bool TokenizeTurn(const std::string& text, std::vector<llama_token>& tokens) const;
+  bool TrimContext(std::vector<llama_token>& tokens);
+  bool ShiftContext(std::vector<llama_token>& tokens);
+  bool StartSession();
+  bool RestorePrefix();
+  bool BuildPrefix(const std::string& key);
+  void ReleasePrefix();
+  bool PrepareTurn(const std::string& prompt);
+  bool AcceptToken(llama_token token);
+  bool TokenToPiece(llama_token token, std::string& piece) const;
+  bool QueueNext(llama_token token);
+  bool LoadDraftModel();
+  void DraftTokens(llama_token token, int32_t max_tokens);
+  void LookupTokens(llama_token token, int32_t max_tokens);
+  void SyncDraft(size_t keep);
+  void PushEvent(LlamaChatEvent event);
+  size_t SegmentCut(const std::string& piece, std::chrono::steady_clock::time_point now) const;
+  void FlushSegment(size_t length, std::chrono::steady_clock::time_point now);
+  bool BudgetSpent();
+  bool WrappingUp(std::chrono::steady_clock::time_point now);
+  void BuildSampler();
+  llama_token Sample(llama_context* ctx, int32_t index);
+  bool SampleNext(llama_context* ctx);
+  void FinishTurn();
+  void RollbackTurn();
+
+  std::shared_ptr<LlamaEngine> engine_;
+  llama_seq_id seq_id_ = -1;                 // This chat's sequence in the engine
+
+  // Draft model for speculative decoding, its sequence mirrors the start of
+  // context_tokens_
+  std::string draft_model_path_;
+  std::shared_ptr<LlamaEngine> draft_engine_;
+  llama_seq_id draft_seq_ = -1;
+  llama_sampler* draft_smpl_ = nullptr;
+  size_t draft_past_ = 0;                    // Tokens in the draft sequence
+  WhillatsSpeculativeMode speculative_mode_ = WhillatsSpeculativeMode::None;
+
+  std::string system_prompt_;
+  std::shared_ptr<const LlamaPrefixSnapshot> prefix_;  // Referenced in the engine under prefix_key_
+  std::string prefix_key_;
+  bool session_started_ = false;
+
+  WhillatsLlamaStats stats_;
+  mutable std::mutex stats_mutex_;
+
+  std::vector<std::pair<std::string, std::string>> messages_;  // role, content
+  size_t formatted_len_ = 0;                  // Templated history already in the KV cache
+  std::vector<llama_token> context_tokens_;   // Tokens in the KV cache, in position order
+  std::vector<LlamaTurnSpan> turns_;          // Committed turns after the system prefix
+  size_t replayed_messages_ = 0;              // Trailing messages not in the KV cache yet
+  std::vector<std::string> stop_strings_;
+  size_t max_context_tokens_ = 2048;          // Dialogue limit, config_.session_ctx within n_ctx
+  const size_t response_reserve_tokens_ = 256;
+
+  // Turn in flight, touched by the engine thread between Submit() and done
+  std::vector<llama_token> pending_;          // Tokens still to decode
+  size_t pending_offset_ = 0;
+  int32_t scheduled_ = 0;                     // Tokens put in the current step's batch
+  int32_t logits_index_ = -1;                 // Batch index to sample from, -1 mid prefill
+  size_t draft_count_ = 0;                    // Draft tokens after the first pending one
+  size_t prefill_tokens_ = 0;
+  std::chrono::steady_clock::time_point prefill_start_;
+  size_t turn_start_ = 0;                     // Context size before the turn
+  size_t turn_message_ = 0;                   // First message the turn's prefill covers
+  bool decode_failed_ = false;
+  std::string response_;
+  std::string current_phrase_;               // Text not handed out yet
+  WhillatsSegmentConfig segment_config_;
+  std::chrono::steady_clock::time_point segment_start_;   // First token in current_phrase_
+  std::chrono::steady_clock::time_point last_flush_;
+  int generated_tokens_ = 0;
+  LlamaStopEngine stop_engine_;
+  LlamaStopReason stop_reason_ = LlamaStopReason::None;
+  WhillatsLlamaBudget budget_;
+  WhillatsSamplerConfig sampler_config_;
+  std::chrono::steady_clock::duration sample_time_{0};    // This turn's
+  uint32_t samples_ = 0;
+  uint64_t sampled_turns_ = 0;
+  WhillatsLlamaStopReason turn_stop_ = WhillatsLlamaStopReason::EndOfGeneration;
+  bool stream_tokens_ = false;
+  bool record_turn_ = false;                  // Keep the delivered output in last_turn_
+  LlamaCachedResponse last_turn_;
+  uint32_t tokens_sampled_ = 0;
+  uint32_t generation_steps_ = 0;
+  std::chrono::steady_clock::time_point first_token_time_;
+  std::chrono::steady_clock::time_point last_token_time_;
+
+  // Tokens and completed phrases, delivered to the callbacks on the caller's thread
+  std::queue<LlamaChatEvent> events_;
+  bool turn_done_ = false;
+  std::mutex events_mutex_;
+  std::condition_variable events_condition_;
 };
 
+// A prompt waiting for the processing thread
+struct LlamaRequest {
+  std::string prompt;
+  int priority = 0;                  // Higher goes first
+  uint64_t order = 0;                // Arrival, first in first out within a priority
+  std::chrono::steady_clock::time_point enqueued;
+  bool has_deadline = false;
+  std::chrono::steady_clock::time_point deadline;   // Dropped if still queued by then
+  WhillatsLlamaBudget budget;
+};
+
+struct LlamaRequestLater {
+  bool operator()(const LlamaRequest& a, const LlamaRequest& b) const {
+    return a.priority != b.priority ? a.priority < b.priority : a.order > b.order;
+  }
+};
+
+typedef std::priority_queue<LlamaRequest, std::vector<LlamaRequest>, LlamaRequestLater> LlamaRequestQueue;
+
 class LlamaDeviceBase {
 public:
   LlamaDeviceBase(const char* model_path, WhillatsSetResponseCallback callback);
@@ -76,7 +266,30 @@ public:
 
   bool start();
   void stop();
-  void askLlama(const char* prompt);
+  void askLlama(const char* prompt, int priority = 0, uint32_t deadline_ms = 0,
+                const WhillatsLlamaBudget& budget = WhillatsLlamaBudget());
+  void cancel();
+  void replace(const char* prompt);
+  void setConfig(const WhillatsLlamaConfig& config);
+  void setTokenCallback(WhillatsSetTokenCallback callback);
+  void setDoneCallback(WhillatsSetDoneCallback callback);
+  void setDraftModel(const char* model_path);
+  void setSpeculativeMode(WhillatsSpeculativeMode mode);
+  void setSegmentation(const WhillatsSegmentConfig& config);
+  void setSampler(const WhillatsSamplerConfig& config);
+  void setStopStrings(const std::vector<std::string>& stops);
+  void setSystemPrompt(const char* prompt);
+  void resetConversation();
+  void setResponseCache(size_t max_bytes, uint32_t ttl_ms);
+  bool saveSession(const char* path);
+  bool loadSession(const char* path);
+  WhillatsLlamaStats getStats() const;
+  int addModel(const char* model_path, uint32_t max_prompt_chars);
+  void addRoutingKeyword(const char* keyword, int model);
+  void setRouterModel(const char* model_path);
+  void addRouterLabel(const char* label, int model);
+  std::vector<WhillatsLlamaModelStats> getModelStats() const;
+  bool swapModel(const char* model_path, int model);
   
   // Add callback setters
 private:
@@ -85,22 +298,51 @@ private:
   std::string _model_path;
 
   WhillatsSetResponseCallback _responseCallback;  // Add callback member
+  LlamaSimpleChat* _activeChat = nullptr;         // Answering a prompt, guarded by _queueMutex
+  uint64_t _cancels = 0;                          // cancel() calls, guarded by _queueMutex
+  WhillatsSetTokenCallback _tokenCallback;        // Guarded by _queueMutex
+  WhillatsSetDoneCallback _doneCallback;          // Guarded by _queueMutex
   
   void processPrompts();
   bool initialize();
   bool RunProcessingThread();
+  size_t LastChat() const;
+  void SwapModel(const std::string& model_path, int model, std::chrono::steady_clock::time_point start);
+
+  // One chat per hosted model, all on the same dialogue. Model 0 is the
+  // main one, the router picks among them per prompt.
+  std::vector<std::unique_ptr<LlamaSimpleChat>> _chats;
+  size_t _lastChat = 0;                           // Answered the last prompt, guarded by _queueMutex
+  LlamaRouter _router;
+  std::vector<std::pair<std::string, uint32_t>> _extraModels;    // Path, max prompt chars
+  std::vector<std::pair<std::string, int>> _routingKeywords;
+  std::string _routerModelPath;
+  std::vector<std::pair<std::string, int>> _routerLabels;        // Label, model
+  std::vector<WhillatsLlamaModelStats> _modelStats;
 
-  std::unique_ptr<LlamaSimpleChat> _llama_chat;
+  // Model hot swap, one at a time
+  std::thread _swapThread;
+  bool _swapping = false;                         // Guarded by _queueMutex
 
-  // Incoming ask text queue
-  std::queue<std::string> _textQueue;
-  std::mutex _queueMutex;
+  // Incoming requests, the processing thread sleeps on _queueCondition
+  // until there is one
+  LlamaRequestQueue _requests;
+  uint64_t _requestOrder = 0;
+  uint64_t _requestsServed = 0;
+  WhillatsLlamaStats _queueStats;                 // Only the queue fields are used
+  LlamaResponseCache _responseCache;
+  mutable std::mutex _queueMutex;
   std::condition_variable _queueCondition;
+  std::mutex _sessionMutex;                       // Held by the processing thread while it uses the chat
 
-  // Add these new members
-  std::vector<llama_token> context_tokens_;
-  const size_t max_context_tokens_ = 2048; // Adjust based on your model   
-  
-  bool TrimContext();
-  bool AppendToContext(const std::vector<llama_token>& new_tokens);
+  // Session settings, applied by the processing thread before the next prompt
+  std::string _systemPrompt;
+  bool _sessionReset = false;
+  std::string _draftModelPath;
+  WhillatsLlamaConfig _config;
+  std::vector<std::string> _stopStrings;
+  bool _stopStringsChanged = false;
+  WhillatsSpeculativeMode _speculativeMode = WhillatsSpeculativeMode::None;
+  WhillatsSegmentConfig _segmentConfig;
+  WhillatsSamplerConfig _samplerConfig;
 };
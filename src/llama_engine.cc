@@ -0,0 +1,568 @@
+/*
+ *  (c) 2025, wilddolphin2022
+ *  For WebRTCsays.ai project
+ *  https://github.com/wilddolphin2022
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree. An additional intellectual property rights grant can be found
+ *  in the file PATENTS.  All contributing project authors may
+ *  be found in the AUTHORS file in the root of the source tree.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+
+#include <llama.h>
+#include "llama_engine.h"
+
+static const size_t kMaxResidentPrefixes = 4;  // Distinct system prompts kept prefilled
+
+static ggml_type ToGgmlType(WhillatsKVCacheType type)
+{
+  switch (type)
+  {
+  case WhillatsKVCacheType::Q8_0:
+    return GGML_TYPE_Q8_0;
+  case WhillatsKVCacheType::Q4_0:
+    return GGML_TYPE_Q4_0;
+  default:
+    return GGML_TYPE_F16;
+  }
+}
+
+// Engines by model path. Weak, so an engine goes away with its last chat.
+// Replaced paths resolve to their replacement's.
+static std::mutex g_enginesMutex;
+static std::map<std::string, std::weak_ptr<LlamaEngine>> g_engines;
+static std::map<std::string, std::string> g_replacedPaths;
+static std::once_flag g_backendsLoaded;
+
+// Caller holds g_enginesMutex
+static std::string ResolvePath(const std::string &model_path)
+{
+  auto it = g_replacedPaths.find(model_path);
+  return it != g_replacedPaths.end() ? it->second : model_path;
+}
+
+std::shared_ptr<LlamaEngine> LlamaEngine::Acquire(const std::string &model_path, int ngl,
+                                                  const WhillatsLlamaConfig &config)
+{
+  std::call_once(g_backendsLoaded, [] { ggml_backend_load_all(); });
+
+  std::lock_guard<std::mutex> lock(g_enginesMutex);
+  const std::string path = ResolvePath(model_path);
+  auto it = g_engines.find(path);
+  if (it != g_engines.end())
+  {
+    if (auto engine = it->second.lock())
+    {
+      if (engine->config_.n_ctx != config.n_ctx || engine->config_.n_batch != config.n_batch ||
+          engine->config_.n_ubatch != config.n_ubatch || engine->config_.n_seq_max != config.n_seq_max ||
+          engine->config_.type_k != config.type_k || engine->config_.type_v != config.type_v ||
+          engine->config_.flash_attn != config.flash_attn)
+      {
+        LOG_W("Llama engine for " << path << " is already running, its context setup applies");
+      }
+      return engine;
+    }
+  }
+
+  std::shared_ptr<LlamaEngine> engine(new LlamaEngine(path, ngl, config));
+  if (!engine->Load())
+  {
+    return nullptr;
+  }
+  g_engines[path] = engine;
+  return engine;
+}
+
+std::shared_ptr<LlamaEngine> LlamaEngine::Replace(const std::string &model_path, const std::string &replacement_path,
+                                                  int ngl, const WhillatsLlamaConfig &config)
+{
+  std::call_once(g_backendsLoaded, [] { ggml_backend_load_all(); });
+
+  // The replacement is sized like the engine it replaces
+  std::shared_ptr<LlamaEngine> current;
+  std::shared_ptr<LlamaEngine> engine;
+  std::string current_path;
+  {
+    std::lock_guard<std::mutex> lock(g_enginesMutex);
+    current_path = ResolvePath(model_path);
+    auto it = g_engines.find(current_path);
+    current = it != g_engines.end() ? it->second.lock() : nullptr;
+    if (replacement_path != current_path)
+    {
+      it = g_engines.find(replacement_path);
+      engine = it != g_engines.end() ? it->second.lock() : nullptr;
+    }
+  }
+
+  if (!engine)
+  {
+    engine.reset(new LlamaEngine(replacement_path, current ? current->ngl_ : ngl,
+                                 current ? current->config_ : config));
+    if (!engine->Load())
+    {
+      return nullptr;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(g_enginesMutex);
+  g_engines[replacement_path] = engine;
+  g_replacedPaths.erase(replacement_path);
+  for (auto &replaced : g_replacedPaths)
+  {
+    if (replaced.second == current_path)
+    {
+      replaced.second = replacement_path;
+    }
+  }
+  if (model_path != replacement_path)
+  {
+    g_replacedPaths[model_path] = replacement_path;
+  }
+  if (current_path != replacement_path)
+  {
+    g_replacedPaths[current_path] = replacement_path;
+  }
+  LOG_I("Llama engine for " << model_path << " replaced by " << replacement_path
+        << (current ? ", sessions on the old one keep it until they end" : ""));
+  return engine;
+}
+
+LlamaEngine::LlamaEngine(const std::string &model_path, int ngl, const WhillatsLlamaConfig &config)
+    : model_path_(model_path),
+      ngl_(ngl),
+      config_(config)
+{
+  config_.n_batch = std::max<uint32_t>(config_.n_batch, 32);
+  config_.n_ubatch = std::min(std::max<uint32_t>(config_.n_ubatch, 32), config_.n_batch);
+  config_.n_seq_max = std::max<uint32_t>(config_.n_seq_max, 1);
+  config_.prefill_chunk = std::max<uint32_t>(config_.prefill_chunk, 1);
+  seq_in_use_.assign(config_.n_seq_max, false);
+  if (config_.type_v != WhillatsKVCacheType::F16 && !config_.flash_attn)
+  {
+    LOG_W("A quantized V cache needs flash attention, keeping V in F16");
+    config_.type_v = WhillatsKVCacheType::F16;
+  }
+}
+
+LlamaEngine::~LlamaEngine()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  jobs_condition_.notify_all();
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+
+  if (batch_)
+  {
+    llama_batch_free(*batch_);
+    delete batch_;
+  }
+  if (ctx_)
+  {
+    llama_free(ctx_);
+  }
+  if (model_)
+  {
+    llama_model_free(model_);
+  }
+}
+
+bool LlamaEngine::Load()
+{
+  if (model_path_.empty())
+  {
+    LOG_E("Model path not set.");
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  llama_model_params model_params = llama_model_default_params();
+  model_params.n_gpu_layers = ngl_;
+  model_params.use_mmap = config_.use_mmap;
+  model_params.use_mlock = config_.use_mlock;
+  model_ = llama_model_load_from_file(model_path_.c_str(), model_params);
+  if (!model_)
+  {
+    LOG_E("Unable to load model.");
+    return false;
+  }
+  vocab_ = llama_model_get_vocab(model_);
+  Fingerprint();
+
+  llama_context_params ctx_params = llama_context_default_params();
+  ctx_params.n_ctx = config_.n_ctx;
+  ctx_params.n_batch = config_.n_batch;
+  ctx_params.n_ubatch = config_.n_ubatch;
+  ctx_params.n_seq_max = config_.n_seq_max;
+  ctx_params.type_k = ToGgmlType(config_.type_k);
+  ctx_params.type_v = ToGgmlType(config_.type_v);
+  ctx_params.flash_attn = config_.flash_attn;
+  ctx_params.no_perf = false;
+
+  ctx_ = llama_init_from_model(model_, ctx_params);
+  if (!ctx_)
+  {
+    LOG_E("Failed to create the llama_context.");
+    return false;
+  }
+
+  batch_ = new llama_batch(llama_batch_init(config_.n_batch, 0, 1));
+
+  // Each layer caches n_head_kv heads of K and V per token
+  const int64_t n_head = std::max<int32_t>(llama_model_n_head(model_), 1);
+  const int64_t n_embd_kv = (int64_t)llama_model_n_embd(model_) / n_head * llama_model_n_head_kv(model_);
+  kv_bytes_per_token_ = (uint64_t)llama_model_n_layer(model_) *
+                        (ggml_row_size(ctx_params.type_k, n_embd_kv) + ggml_row_size(ctx_params.type_v, n_embd_kv));
+  memory_bytes_ = llama_model_size(model_) + kv_bytes_per_token_ * llama_n_ctx(ctx_);
+  load_ms_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  running_ = true;
+  thread_ = std::thread([this] { Run(); });
+
+  LOG_I("Llama engine ready: " << model_path_ << ", " << llama_n_ctx(ctx_) << " KV cells, batch "
+        << config_.n_batch << "/" << config_.n_ubatch << ", " << config_.n_seq_max << " sequences, "
+        << kv_bytes_per_token_ * llama_n_ctx(ctx_) / (1024 * 1024) << " MiB KV cache"
+        << (config_.flash_attn ? " with flash attention" : "") << ", loaded in "
+        << load_ms_ << " ms" << (config_.use_mmap ? " mapped" : "") << (config_.use_mlock ? " locked" : ""));
+  return true;
+}
+
+double LlamaEngine::WarmupMs() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return warmup_ms_;
+}
+
+// Runs first on the engine thread. Reading the file through pulls mapped
+// weights into the page cache, and one throwaway decode sets up the backend
+// buffers, so the first real prefill doesn't pay for either. Jobs submitted
+// meanwhile wait for it.
+void LlamaEngine::Warmup()
+{
+  auto start = std::chrono::steady_clock::now();
+
+  if (config_.use_mmap)
+  {
+    std::ifstream file(model_path_, std::ios::binary);
+    std::vector<char> chunk(1 << 20);
+    while (file.read(chunk.data(), chunk.size()) || file.gcount() > 0)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!running_)
+      {
+        return;
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  const llama_seq_id seq_id = AcquireSequence();
+  if (seq_id >= 0)
+  {
+    std::vector<llama_token> tokens;
+    const llama_token bos = llama_vocab_bos(vocab_);
+    const llama_token eos = llama_vocab_eos(vocab_);
+    if (bos >= 0)
+    {
+      tokens.push_back(bos);
+    }
+    if (eos >= 0)
+    {
+      tokens.push_back(eos);
+    }
+    if (tokens.empty())
+    {
+      tokens.push_back(0);
+    }
+    DecodeSequence(tokens, seq_id, 0, true);
+    ReleaseSequence(seq_id);
+  }
+  warmup_ms_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  LOG_I("Llama engine warmed up in " << warmup_ms_ << " ms");
+}
+
+// FNV-1a over the model's GGUF metadata and sizes. Hashing the weights
+// themselves would cost a full read of the file on every load.
+void LlamaEngine::Fingerprint()
+{
+  uint64_t hash = 14695981039346656037ull;
+  auto mix = [&hash](const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+  };
+
+  char buf[256];
+  const int32_t n_meta = llama_model_meta_count(model_);
+  for (int32_t i = 0; i < n_meta; ++i)
+  {
+    int32_t n = llama_model_meta_key_by_index(model_, i, buf, sizeof(buf));
+    mix(buf, std::max<int32_t>(0, std::min<int32_t>(n, sizeof(buf) - 1)));
+    n = llama_model_meta_val_str_by_index(model_, i, buf, sizeof(buf));
+    mix(buf, std::max<int32_t>(0, std::min<int32_t>(n, sizeof(buf) - 1)));
+  }
+  const uint64_t sizes[] = {llama_model_size(model_), llama_model_n_params(model_),
+                            (uint64_t)llama_vocab_n_tokens(vocab_)};
+  mix(sizes, sizeof(sizes));
+  fingerprint_ = hash;
+}
+
+llama_seq_id LlamaEngine::AcquireSequence()
+{
+  for (size_t i = 0; i < seq_in_use_.size(); ++i)
+  {
+    if (!seq_in_use_[i])
+    {
+      seq_in_use_[i] = true;
+      return i;
+    }
+  }
+  LOG_E("No free KV sequence, " << seq_in_use_.size() << " in use");
+  return -1;
+}
+
+void LlamaEngine::ReleaseSequence(llama_seq_id seq_id)
+{
+  if (seq_id >= 0 && seq_id < (llama_seq_id)seq_in_use_.size())
+  {
+    llama_kv_cache_seq_rm(ctx_, seq_id, -1, -1);
+    seq_in_use_[seq_id] = false;
+  }
+}
+
+llama_seq_id LlamaEngine::AcquirePrefix(const std::string &key,
+                                        std::shared_ptr<const LlamaPrefixSnapshot> &snapshot)
+{
+  auto it = prefixes_.find(key);
+  if (it == prefixes_.end())
+  {
+    return -1;
+  }
+  it->second.refs++;
+  it->second.last_used = ++prefix_clock_;
+  snapshot = it->second.snapshot;
+  return it->second.seq_id;
+}
+
+// Prefixes get at most half the sequences, the rest are for chats
+void LlamaEngine::AddPrefix(const std::string &key, llama_seq_id seq_id,
+                            std::shared_ptr<const LlamaPrefixSnapshot> snapshot)
+{
+  auto existing = prefixes_.find(key);
+  if (existing != prefixes_.end())
+  {
+    EvictPrefix(existing);
+  }
+  const size_t cap = std::max<size_t>(1, std::min<size_t>(kMaxResidentPrefixes, seq_in_use_.size() / 2));
+  while (prefixes_.size() >= cap)
+  {
+    auto oldest = prefixes_.begin();
+    for (auto it = prefixes_.begin(); it != prefixes_.end(); ++it)
+    {
+      if (it->second.last_used < oldest->second.last_used)
+      {
+        oldest = it;
+      }
+    }
+    LOG_I("Evicting the least recently used system prompt prefix, " << oldest->second.refs << " chats hold it");
+    EvictPrefix(oldest);
+  }
+
+  ResidentPrefix &prefix = prefixes_[key];
+  prefix.seq_id = seq_id;
+  prefix.snapshot = std::move(snapshot);
+  prefix.refs = 1;
+  prefix.last_used = ++prefix_clock_;
+}
+
+// A reference to an evicted or replaced prefix has nothing left to release
+void LlamaEngine::ReleasePrefix(const std::string &key, const std::shared_ptr<const LlamaPrefixSnapshot> &snapshot)
+{
+  auto it = prefixes_.find(key);
+  if (it == prefixes_.end() || it->second.snapshot != snapshot)
+  {
+    return;
+  }
+  if (--it->second.refs == 0)
+  {
+    EvictPrefix(it);
+  }
+}
+
+llama_seq_id LlamaEngine::PrefixSequence(const std::string &key,
+                                         const std::shared_ptr<const LlamaPrefixSnapshot> &snapshot) const
+{
+  auto it = prefixes_.find(key);
+  if (it == prefixes_.end() || it->second.snapshot != snapshot)
+  {
+    return -1;
+  }
+  return it->second.seq_id;
+}
+
+void LlamaEngine::EvictPrefix(std::map<std::string, ResidentPrefix>::iterator it)
+{
+  ReleaseSequence(it->second.seq_id);
+  prefixes_.erase(it);
+}
+
+bool LlamaEngine::DecodeSequence(const std::vector<llama_token> &tokens, llama_seq_id seq_id, llama_pos pos,
+                                 bool logits_last)
+{
+  for (size_t start = 0; start < tokens.size(); start += config_.n_batch)
+  {
+    const size_t n = std::min<size_t>(config_.n_batch, tokens.size() - start);
+    llama_batch &batch = *batch_;
+    batch.n_tokens = n;
+    for (size_t i = 0; i < n; ++i)
+    {
+      batch.token[i] = tokens[start + i];
+      batch.pos[i] = pos + start + i;
+      batch.n_seq_id[i] = 1;
+      batch.seq_id[i][0] = seq_id;
+      batch.logits[i] = logits_last && start + i + 1 == tokens.size();
+    }
+    if (llama_decode(ctx_, batch) != 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void LlamaEngine::Submit(LlamaEngineJob *job)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back(job);
+  }
+  jobs_condition_.notify_one();
+}
+
+uint32_t LlamaEngine::ActiveJobs() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return jobs_.size();
+}
+
+double LlamaEngine::TokensPerSecond() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return decode_ms_ > 0 ? tokens_decoded_ * 1000.0 / decode_ms_ : 0;
+}
+
+double LlamaEngine::AverageBatchJobs() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return steps_ > 0 ? (double)step_jobs_ / steps_ : 0;
+}
+
+void LlamaEngine::Run()
+{
+  if (config_.warmup)
+  {
+    Warmup();
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (running_)
+  {
+    jobs_condition_.wait(lock, [this] { return !jobs_.empty() || !running_; });
+    if (!running_)
+    {
+      break;
+    }
+    Step();
+
+    // Let sequence edits and new submissions in between steps
+    lock.unlock();
+    std::this_thread::yield();
+    lock.lock();
+  }
+}
+
+// One decode over all active jobs. Generating jobs go first so their tokens
+// always fit, prefills fill the rest of the batch in chunks. A chunk is at
+// least prefill_chunk tokens, or an even share of the batch, so a long prompt
+// alone gets the whole batch but can't hold back shorter ones.
+bool LlamaEngine::Step()
+{
+  std::stable_sort(jobs_.begin(), jobs_.end(), [](LlamaEngineJob *a, LlamaEngineJob *b) {
+    return a->PendingTokens() < b->PendingTokens();
+  });
+
+  llama_batch &batch = *batch_;
+  batch.n_tokens = 0;
+  std::vector<LlamaEngineJob *> scheduled;
+  const int32_t share = std::max<int32_t>(config_.prefill_chunk, config_.n_batch / jobs_.size());
+  for (LlamaEngineJob *job : jobs_)
+  {
+    const int32_t budget = (int32_t)config_.n_batch - batch.n_tokens;
+    if (budget <= 0)
+    {
+      break;
+    }
+    if (job->Schedule(batch, std::min(budget, share)) > 0)
+    {
+      scheduled.push_back(job);
+    }
+  }
+
+  if (scheduled.empty())
+  {
+    return true;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  const int32_t n_tokens = batch.n_tokens;
+  bool ok = llama_decode(ctx_, batch) == 0;
+
+  std::vector<LlamaEngineJob *> finished;
+  if (ok || scheduled.size() == 1)
+  {
+    for (LlamaEngineJob *job : scheduled)
+    {
+      if (job->OnDecoded(ctx_, ok))
+      {
+        finished.push_back(job);
+      }
+    }
+  }
+  else
+  {
+    // Most likely out of KV cells. Retry each job on its own so one session
+    // running out of room doesn't fail the others.
+    LOG_W("Batched decode of " << n_tokens << " tokens failed, retrying per session");
+    for (LlamaEngineJob *job : scheduled)
+    {
+      batch.n_tokens = 0;
+      job->Schedule(batch, config_.n_batch);
+      if (job->OnDecoded(ctx_, llama_decode(ctx_, batch) == 0))
+      {
+        finished.push_back(job);
+      }
+    }
+  }
+
+  steps_++;
+  step_jobs_ += scheduled.size();
+  tokens_decoded_ += n_tokens;
+  decode_ms_ += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  for (LlamaEngineJob *job : finished)
+  {
+    jobs_.erase(std::remove(jobs_.begin(), jobs_.end(), job), jobs_.end());
+  }
+  return ok;
+}
@@ -0,0 +1,171 @@
+/*
+ *  (c) 2025, wilddolphin2022
+ *  For WebRTCsays.ai project
+ *  https://github.com/wilddolphin2022
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree. An additional intellectual property rights grant can be found
+ *  in the file PATENTS.  All contributing project authors may
+ *  be found in the AUTHORS file in the root of the source tree.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "whisper_helpers.h"
+#include "whillats.h"
+
+struct llama_model;
+struct llama_context;
+struct llama_vocab;
+struct llama_batch;
+typedef int32_t llama_token;
+typedef int32_t llama_pos;
+typedef int32_t llama_seq_id;
+
+struct LlamaPrefixSnapshot;
+
+// Work the engine batches together each decode step. Implemented by the chat
+// sessions, every call happens on the engine thread with the engine mutex held.
+class LlamaEngineJob {
+public:
+  virtual ~LlamaEngineJob() = default;
+
+  // Tokens still to feed, the engine schedules small jobs (generation) first
+  virtual int32_t PendingTokens() const = 0;
+
+  // Add this step's tokens to batch, at most budget of them, and return how
+  // many. A failed step may call it again for the same step, only the last
+  // call before OnDecoded() counts. A job with tokens pending must schedule
+  // at least one of them for any positive budget.
+  virtual int32_t Schedule(llama_batch& batch, int32_t budget) = 0;
+
+  // The step's decode finished, ok is false if it failed. Return true once
+  // the job is done and should leave the engine.
+  virtual bool OnDecoded(llama_context* ctx, bool ok) = 0;
+};
+
+// One model and one context shared by every chat on the same model. Engines
+// live in a process-wide registry by model path and go away with their last
+// reference, the first Acquire() pays the load. Replace() swaps the engine
+// behind a path without touching the chats already on it. Each chat
+// owns a KV sequence, and a single thread decodes all active chats together:
+// each step's batch mixes prefill chunks and generation tokens.
+class LlamaEngine {
+public:
+  // The first chat on a model sizes its engine, later ones share it as is
+  static std::shared_ptr<LlamaEngine> Acquire(const std::string& model_path, int ngl,
+                                              const WhillatsLlamaConfig& config);
+  // Loads replacement_path, without holding up other Acquire() calls, then
+  // points model_path at it: later Acquire() calls for either path get the
+  // new engine. Chats on the old one keep it until they let go. A replacement
+  // on the same path is loaded afresh.
+  static std::shared_ptr<LlamaEngine> Replace(const std::string& model_path, const std::string& replacement_path,
+                                              int ngl, const WhillatsLlamaConfig& config);
+  ~LlamaEngine();
+
+  llama_model* model() const { return model_; }
+  const llama_vocab* vocab() const { return vocab_; }
+  llama_context* context() const { return ctx_; }
+  const WhillatsLlamaConfig& config() const { return config_; }
+
+  // Identifies the model's weights and vocabulary, saved sessions only load
+  // into an engine with the same fingerprint
+  uint64_t fingerprint() const { return fingerprint_; }
+
+  // KV cache memory per token, over all layers, K and V
+  uint64_t KVBytesPerToken() const { return kv_bytes_per_token_; }
+
+  // Weights plus the whole KV cache
+  uint64_t MemoryBytes() const { return memory_bytes_; }
+
+  double LoadMs() const { return load_ms_; }
+  double WarmupMs() const;
+
+  // Guards the context for work outside the decode loop, like KV sequence
+  // edits and state restores
+  std::mutex& mutex() { return mutex_; }
+
+  // Sequence ids, -1 when all are taken. Caller holds mutex().
+  llama_seq_id AcquireSequence();
+  void ReleaseSequence(llama_seq_id seq_id);
+
+  // System prompt prefixes resident in their own sequence, counted by the
+  // chats that use them. AcquirePrefix references an existing one, AddPrefix
+  // publishes a new one holding the caller's reference and the last
+  // ReleasePrefix frees its sequence. Past the resident cap the least
+  // recently used prefix is evicted, PrefixSequence() then no longer finds
+  // it for its holders. Caller holds mutex().
+  llama_seq_id AcquirePrefix(const std::string& key, std::shared_ptr<const LlamaPrefixSnapshot>& snapshot);
+  void AddPrefix(const std::string& key, llama_seq_id seq_id, std::shared_ptr<const LlamaPrefixSnapshot> snapshot);
+  void ReleasePrefix(const std::string& key, const std::shared_ptr<const LlamaPrefixSnapshot>& snapshot);
+  llama_seq_id PrefixSequence(const std::string& key,
+                              const std::shared_ptr<const LlamaPrefixSnapshot>& snapshot) const;
+
+  // Decode tokens into one sequence outside the batch loop, with logits for
+  // the last one on request. Caller holds mutex().
+  bool DecodeSequence(const std::vector<llama_token>& tokens, llama_seq_id seq_id, llama_pos pos,
+                      bool logits_last = false);
+
+  // Hand a job to the decode loop, OnDecoded() reports its completion
+  void Submit(LlamaEngineJob* job);
+
+  uint32_t ActiveJobs() const;
+  double TokensPerSecond() const;
+  double AverageBatchJobs() const;
+
+private:
+  LlamaEngine(const std::string& model_path, int ngl, const WhillatsLlamaConfig& config);
+  bool Load();
+  void Fingerprint();
+  void Warmup();
+  void Run();
+  bool Step();
+
+  std::string model_path_;
+  int ngl_;
+  WhillatsLlamaConfig config_;
+
+  llama_model* model_ = nullptr;
+  const llama_vocab* vocab_ = nullptr;
+  llama_context* ctx_ = nullptr;
+  llama_batch* batch_ = nullptr;
+  uint64_t fingerprint_ = 0;
+  uint64_t kv_bytes_per_token_ = 0;
+  uint64_t memory_bytes_ = 0;
+  double load_ms_ = 0;
+  double warmup_ms_ = 0;                     // Guarded by mutex_
+
+  struct ResidentPrefix {
+    llama_seq_id seq_id = -1;
+    std::shared_ptr<const LlamaPrefixSnapshot> snapshot;
+    uint32_t refs = 0;
+    uint64_t last_used = 0;
+  };
+  void EvictPrefix(std::map<std::string, ResidentPrefix>::iterator it);
+
+  std::vector<bool> seq_in_use_;
+  std::map<std::string, ResidentPrefix> prefixes_;
+  uint64_t prefix_clock_ = 0;
+
+  std::vector<LlamaEngineJob*> jobs_;
+  mutable std::mutex mutex_;
+  std::condition_variable jobs_condition_;
+  std::thread thread_;
+  bool running_ = false;
+
+  // Aggregate throughput, guarded by mutex_
+  uint64_t steps_ = 0;
+  uint64_t step_jobs_ = 0;
+  uint64_t tokens_decoded_ = 0;
+  double decode_ms_ = 0;
+};
@@ -0,0 +1,132 @@
+/*
+ *  (c) 2025, wilddolphin2022
+ *  For WebRTCsays.ai project
+ *  https://github.com/wilddolphin2022
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree. An additional intellectual property rights grant can be found
+ *  in the file PATENTS.  All contributing project authors may
+ *  be found in the AUTHORS file in the root of the source tree.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// A turn's output as the callbacks saw it, enough to play it back
+struct LlamaCachedResponse {
+    std::string response;
+    std::vector<std::string> phrases;   // Response callback texts, in order
+    std::vector<std::string> tokens;    // Token callback texts, in order
+};
+
+// Answers by prompt, for the short questions callers ask over and over. The
+// key is the prompt, normalized with normalizeText(), plus whatever else shapes the answer (the
+// dialogue before it, sampling settings), built by the caller. Entries expire
+// after a TTL and the least recently used go first once the memory budget is
+// spent. Thread-safe.
+class LlamaResponseCache {
+public:
+    // max_bytes 0 turns the cache off and empties it, ttl_ms 0 never expires
+    void configure(size_t max_bytes, uint32_t ttl_ms) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _maxBytes = max_bytes;
+        _ttl = std::chrono::milliseconds(ttl_ms);
+        evict(0);
+    }
+
+    bool enabled() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _maxBytes > 0;
+    }
+
+    bool find(const std::string& key, LlamaCachedResponse& response) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _index.find(key);
+        if (it != _index.end() && expired(*it->second)) {
+            _bytes -= it->second->bytes;
+            _entries.erase(it->second);
+            _index.erase(it);
+            it = _index.end();
+        }
+        if (it == _index.end()) {
+            _misses++;
+            return false;
+        }
+        _entries.splice(_entries.begin(), _entries, it->second);
+        response = it->second->response;
+        _hits++;
+        return true;
+    }
+
+    void insert(const std::string& key, const LlamaCachedResponse& response) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        size_t bytes = key.size() + response.response.size() + sizeof(Entry);
+        for (const auto& text : response.phrases) {
+            bytes += text.size() + sizeof(std::string);
+        }
+        for (const auto& text : response.tokens) {
+            bytes += text.size() + sizeof(std::string);
+        }
+        if (bytes > _maxBytes) {
+            return;
+        }
+
+        auto it = _index.find(key);
+        if (it != _index.end()) {
+            _bytes -= it->second->bytes;
+            _entries.erase(it->second);
+            _index.erase(it);
+        }
+        evict(bytes);
+        _entries.push_front(Entry{key, response, bytes, std::chrono::steady_clock::now()});
+        _index[key] = _entries.begin();
+        _bytes += bytes;
+    }
+
+    uint64_t hits() const { std::lock_guard<std::mutex> lock(_mutex); return _hits; }
+    uint64_t misses() const { std::lock_guard<std::mutex> lock(_mutex); return _misses; }
+    uint64_t evictions() const { std::lock_guard<std::mutex> lock(_mutex); return _evictions; }
+    size_t entries() const { std::lock_guard<std::mutex> lock(_mutex); return _entries.size(); }
+    size_t bytes() const { std::lock_guard<std::mutex> lock(_mutex); return _bytes; }
+
+private:
+    struct Entry {
+        std::string key;
+        LlamaCachedResponse response;
+        size_t bytes;
+        std::chrono::steady_clock::time_point added;
+    };
+
+    bool expired(const Entry& entry) const {
+        return _ttl.count() > 0 && std::chrono::steady_clock::now() - entry.added > _ttl;
+    }
+
+    // Make room for bytes more, oldest use first
+    void evict(size_t bytes) {
+        while (!_entries.empty() && _bytes + bytes > _maxBytes) {
+            _bytes -= _entries.back().bytes;
+            _index.erase(_entries.back().key);
+            _entries.pop_back();
+            _evictions++;
+        }
+    }
+
+    size_t _maxBytes = 0;
+    std::chrono::milliseconds _ttl{0};
+    std::list<Entry> _entries;          // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> _index;
+    size_t _bytes = 0;
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+    uint64_t _evictions = 0;
+    mutable std::mutex _mutex;
+};
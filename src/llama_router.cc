@@ -0,0 +1,194 @@
+/*
+ *  (c) 2025, wilddolphin2022
+ *  For WebRTCsays.ai project
+ *  https://github.com/wilddolphin2022
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree. An additional intellectual property rights grant can be found
+ *  in the file PATENTS.  All contributing project authors may
+ *  be found in the AUTHORS file in the root of the source tree.
+ */
+
+#include <algorithm>
+
+#include <llama.h>
+#include "llama_router.h"
+#include "whisper_helpers.h"
+
+static const size_t kClassifierPromptChars = 384;  // Longer prompts are judged by their start
+static const uint32_t kClassifierContext = 512;
+
+LlamaRouter::~LlamaRouter()
+{
+  FreeClassifier();
+}
+
+void LlamaRouter::AddKeyword(const std::string &keyword, int model)
+{
+  const std::string normalized = normalizeText(keyword);
+  if (!normalized.empty())
+  {
+    keywords_.push_back(std::make_pair(normalized, model));
+  }
+}
+
+void LlamaRouter::AddLengthRule(uint32_t max_chars, int model)
+{
+  lengths_.push_back(std::make_pair(max_chars, model));
+  std::stable_sort(lengths_.begin(), lengths_.end());
+}
+
+bool LlamaRouter::LoadClassifier(const std::string &model_path, int ngl, const WhillatsLlamaConfig &config,
+                                 const std::vector<std::pair<std::string, int>> &labels)
+{
+  FreeClassifier();
+  if (labels.empty())
+  {
+    return false;
+  }
+
+  // One sequence, one short prompt at a time
+  WhillatsLlamaConfig classifier_config;
+  classifier_config.n_ctx = kClassifierContext;
+  classifier_config.n_batch = kClassifierContext;
+  classifier_config.n_ubatch = kClassifierContext;
+  classifier_config.n_seq_max = 1;
+  classifier_config.session_ctx = kClassifierContext;
+  classifier_config.use_mmap = config.use_mmap;
+  classifier_config.use_mlock = config.use_mlock;
+  classifier_ = LlamaEngine::Acquire(model_path, ngl, classifier_config);
+  if (!classifier_)
+  {
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(classifier_->mutex());
+    classifier_seq_ = classifier_->AcquireSequence();
+  }
+
+  // Labels must start with distinct tokens to be told apart
+  bool usable = classifier_seq_ >= 0;
+  classifier_labels_.clear();
+  for (size_t i = 0; i < labels.size() && usable; ++i)
+  {
+    const llama_token token = FirstToken(" " + labels[i].first);
+    for (const auto &other : label_tokens_)
+    {
+      usable = usable && other.first != token;
+    }
+    usable = usable && token >= 0;
+    label_tokens_.push_back(std::make_pair(token, labels[i].second));
+    classifier_labels_ += (i == 0 ? "" : (i + 1 == labels.size() ? " or " : ", ")) + labels[i].first;
+  }
+  if (!usable)
+  {
+    LOG_E("Router model " << model_path << " can't be used as a classifier for these labels");
+    FreeClassifier();
+    return false;
+  }
+  return true;
+}
+
+void LlamaRouter::FreeClassifier()
+{
+  if (classifier_ && classifier_seq_ >= 0)
+  {
+    std::lock_guard<std::mutex> lock(classifier_->mutex());
+    classifier_->ReleaseSequence(classifier_seq_);
+  }
+  classifier_seq_ = -1;
+  classifier_.reset();
+  label_tokens_.clear();
+}
+
+void LlamaRouter::Clear()
+{
+  FreeClassifier();
+  keywords_.clear();
+  lengths_.clear();
+}
+
+int LlamaRouter::Route(const std::string &prompt, LlamaRouteReason &reason)
+{
+  const std::string words = " " + normalizeText(prompt) + " ";
+  for (const auto &keyword : keywords_)
+  {
+    if (words.find(" " + keyword.first + " ") != std::string::npos)
+    {
+      reason = LlamaRouteReason::Keyword;
+      return keyword.second;
+    }
+  }
+
+  int model = 0;
+  if (classifier_ && Classify(prompt, model))
+  {
+    reason = LlamaRouteReason::Classifier;
+    return model;
+  }
+
+  for (const auto &length : lengths_)
+  {
+    if (prompt.size() <= length.first)
+    {
+      reason = LlamaRouteReason::Length;
+      return length.second;
+    }
+  }
+
+  reason = LlamaRouteReason::Default;
+  return 0;
+}
+
+// One prefill, then the label whose first token has the highest logit
+bool LlamaRouter::Classify(const std::string &prompt, int &model)
+{
+  const std::string text = "Classify this request as " + classifier_labels_ + ".\n"
+                           "Request: " + prompt.substr(0, kClassifierPromptChars) + "\nAnswer:";
+
+  const llama_vocab *vocab = classifier_->vocab();
+  const int n_tokens = -llama_tokenize(vocab, text.c_str(), text.size(), nullptr, 0, true, true);
+  std::vector<llama_token> tokens(std::max(n_tokens, 0));
+  if (tokens.empty() || tokens.size() >= llama_n_ctx(classifier_->context()) ||
+      llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), true, true) < 0)
+  {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(classifier_->mutex());
+  llama_context *ctx = classifier_->context();
+  bool ok = classifier_->DecodeSequence(tokens, classifier_seq_, 0, true);
+  if (ok)
+  {
+    const float *logits = llama_get_logits_ith(ctx, -1);
+    ok = logits != nullptr;
+    size_t best = 0;
+    for (size_t i = 1; ok && i < label_tokens_.size(); ++i)
+    {
+      if (logits[label_tokens_[i].first] > logits[label_tokens_[best].first])
+      {
+        best = i;
+      }
+    }
+    if (ok)
+    {
+      model = label_tokens_[best].second;
+    }
+  }
+  llama_kv_cache_seq_rm(ctx, classifier_seq_, -1, -1);
+  return ok;
+}
+
+llama_token LlamaRouter::FirstToken(const std::string &text) const
+{
+  std::vector<llama_token> tokens(8);
+  int n = llama_tokenize(classifier_->vocab(), text.c_str(), text.size(), tokens.data(), tokens.size(), false, false);
+  if (n < 0)
+  {
+    tokens.resize(-n);
+    n = llama_tokenize(classifier_->vocab(), text.c_str(), text.size(), tokens.data(), tokens.size(), false, false);
+  }
+  return n > 0 ? tokens[0] : -1;
+}
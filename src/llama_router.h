@@ -0,0 +1,64 @@
+/*
+ *  (c) 2025, wilddolphin2022
+ *  For WebRTCsays.ai project
+ *  https://github.com/wilddolphin2022
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree. An additional intellectual property rights grant can be found
+ *  in the file PATENTS.  All contributing project authors may
+ *  be found in the AUTHORS file in the root of the source tree.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "llama_engine.h"
+
+enum class LlamaRouteReason {
+  Default,        // Nothing matched, the main model
+  Keyword,
+  Classifier,
+  Length
+};
+
+// Picks the model for a prompt among the ones a WhillatsLlama hosts, model 0
+// being its main one. Rules are checked in order: keywords, then the
+// classifier if there is one, then prompt length. All of it is cheap next to
+// a turn, the classifier is a single prefill of a tiny model.
+class LlamaRouter {
+public:
+  LlamaRouter() = default;
+  ~LlamaRouter();
+
+  // Prompts containing keyword, as a whole word and up to case, go to model
+  void AddKeyword(const std::string& keyword, int model);
+  // Prompts up to max_chars long go to model, the tightest limit wins
+  void AddLengthRule(uint32_t max_chars, int model);
+
+  // A small model asked to label the prompt, each label going to a model.
+  // It gets a context of its own sized for one short prompt, config only
+  // lends it the loading options.
+  bool LoadClassifier(const std::string& model_path, int ngl, const WhillatsLlamaConfig& config,
+                      const std::vector<std::pair<std::string, int>>& labels);
+  void FreeClassifier();
+  void Clear();
+
+  int Route(const std::string& prompt, LlamaRouteReason& reason);
+
+private:
+  bool Classify(const std::string& prompt, int& model);
+  llama_token FirstToken(const std::string& text) const;
+
+  std::vector<std::pair<std::string, int>> keywords_;    // Normalized keyword, model
+  std::vector<std::pair<uint32_t, int>> lengths_;        // Sorted by limit
+
+  std::shared_ptr<LlamaEngine> classifier_;
+  llama_seq_id classifier_seq_ = -1;
+  std::string classifier_labels_;                        // "a, b or c" for the prompt
+  std::vector<std::pair<llama_token, int>> label_tokens_;  // First token of each label, model
+};
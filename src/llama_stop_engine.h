@@ -0,0 +1,232 @@
+/*
+ *  (c) 2025, wilddolphin2022
+ *  For WebRTCsays.ai project
+ *  https://github.com/wilddolphin2022
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree. An additional intellectual property rights grant can be found
+ *  in the file PATENTS.  All contributing project authors may
+ *  be found in the AUTHORS file in the root of the source tree.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <queue>
+#include <unordered_map>
+#include <algorithm>
+
+enum class LlamaStopReason {
+    None,
+    EndOfGeneration,    // llama_vocab_is_eog token
+    StopString,         // One of the configured stop strings
+    Repetition,         // The model keeps repeating itself
+    Confirmation        // Filler like "yeah, okay, right" piling up in a phrase
+};
+
+// Decides when a response should end, updated one token piece at a time.
+//
+// Stop strings and filler words share one Aho-Corasick automaton over the
+// lowercased text, built with full transitions so every byte costs one table
+// lookup. Repetition keeps a 4 byte rolling window key for every position in
+// the last kRepeatWindow bytes and counts them, the newest one showing up
+// twice means the text just repeated. All of it is O(1) per byte.
+class LlamaStopEngine {
+public:
+    static constexpr size_t kRepeatWindow = 50;     // Bytes of recent text checked for repetition
+    static constexpr size_t kRepeatGram = 4;        // Shortest repeat that counts
+    static constexpr int kRepeatTokens = 3;         // Repeating tokens tolerated in a row
+    static constexpr int kConfirmWords = 3;         // Distinct filler words that make a phrase filler
+    static constexpr int kConfirmTokens = 2;        // Filler tokens tolerated per turn
+
+    LlamaStopEngine() {
+        _counts.reserve(kRepeatWindow * 2);
+        setStopStrings(std::vector<std::string>());
+    }
+
+    // Stop strings are matched case-insensitively, empty ones are ignored
+    void setStopStrings(const std::vector<std::string>& stops) {
+        static const char* confirmations[] = {
+            "yeah", "okay", "so", "right", "think", "that's", "correct", "makes sense"};
+
+        _nodes.assign(1, Node());
+        for (size_t i = 0; i < sizeof(confirmations) / sizeof(confirmations[0]); ++i) {
+            _nodes[insert(confirmations[i])].confirm |= 1u << i;
+        }
+        for (const auto& stop : stops) {
+            if (!stop.empty()) {
+                Node& node = _nodes[insert(stop)];
+                node.stop = std::max<uint32_t>(node.stop, stop.size());
+            }
+        }
+        build();
+        reset();
+    }
+
+    // Start of a new response
+    void reset() {
+        _state = 0;
+        _head = 0;
+        _size = 0;
+        _key = 0;
+        _counts.clear();
+        _repeatTokens = 0;
+        _confirmTokens = 0;
+        _stopTrim = 0;
+        resetPhrase();
+    }
+
+    // The current phrase was handed out, filler words count per phrase
+    void resetPhrase() {
+        _phraseConfirm = 0;
+    }
+
+    // Feed the next token. eog comes from llama_vocab_is_eog, piece is the
+    // token's text. Returns why the response should end, if it should.
+    LlamaStopReason feed(bool eog, const char* piece, size_t length) {
+        if (eog) {
+            return LlamaStopReason::EndOfGeneration;
+        }
+
+        for (size_t i = 0; i < length; ++i) {
+            const uint8_t c = static_cast<uint8_t>(piece[i]);
+            _state = _nodes[_state].next[lower(c)];
+            _phraseConfirm |= _nodes[_state].confirm;
+            if (_nodes[_state].stop) {
+                _stopTrim = _nodes[_state].stop + (length - i - 1);
+                return LlamaStopReason::StopString;
+            }
+            push(c);
+        }
+
+        if (repeating()) {
+            if (++_repeatTokens > kRepeatTokens) {
+                return LlamaStopReason::Repetition;
+            }
+        } else {
+            _repeatTokens = 0;
+        }
+
+        if (popcount(_phraseConfirm) >= kConfirmWords && ++_confirmTokens > kConfirmTokens) {
+            return LlamaStopReason::Confirmation;
+        }
+        return LlamaStopReason::None;
+    }
+
+    // After StopString: bytes to cut from the end of the text, the stop string
+    // and whatever followed it in the last piece
+    size_t stopTrim() const { return _stopTrim; }
+
+private:
+    struct Node {
+        int32_t next[256];
+        int32_t fail = 0;
+        uint32_t confirm = 0;   // Filler words ending here, one bit each
+        uint32_t stop = 0;      // Length of the longest stop string ending here
+        Node() { std::fill(next, next + 256, -1); }
+    };
+
+    static uint8_t lower(uint8_t c) {
+        return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+
+    static int popcount(uint32_t v) {
+        int n = 0;
+        for (; v; v &= v - 1) {
+            n++;
+        }
+        return n;
+    }
+
+    size_t insert(const std::string& word) {
+        int32_t node = 0;
+        for (char ch : word) {
+            const uint8_t c = lower(static_cast<uint8_t>(ch));
+            if (_nodes[node].next[c] < 0) {
+                _nodes[node].next[c] = _nodes.size();
+                _nodes.push_back(Node());
+            }
+            node = _nodes[node].next[c];
+        }
+        return node;
+    }
+
+    // Breadth first: fail links, inherited outputs and the missing transitions
+    void build() {
+        std::queue<int32_t> queue;
+        for (int c = 0; c < 256; ++c) {
+            int32_t& child = _nodes[0].next[c];
+            if (child < 0) {
+                child = 0;
+            } else {
+                _nodes[child].fail = 0;
+                queue.push(child);
+            }
+        }
+        while (!queue.empty()) {
+            const int32_t node = queue.front();
+            queue.pop();
+            const Node& fail = _nodes[_nodes[node].fail];
+            _nodes[node].confirm |= fail.confirm;
+            _nodes[node].stop = std::max(_nodes[node].stop, fail.stop);
+            for (int c = 0; c < 256; ++c) {
+                const int32_t child = _nodes[node].next[c];
+                if (child < 0) {
+                    _nodes[node].next[c] = _nodes[_nodes[node].fail].next[c];
+                } else {
+                    _nodes[child].fail = _nodes[_nodes[node].fail].next[c];
+                    queue.push(child);
+                }
+            }
+        }
+    }
+
+    // Slide the repetition window by one byte. Each window position holds the
+    // key of the kRepeatGram bytes starting there, once they are all in.
+    void push(uint8_t c) {
+        if (_size == kRepeatWindow) {
+            uncount(_keys[_head]);
+            _head = (_head + 1) % kRepeatWindow;
+            _size--;
+        }
+        _key = (_key << 8) | c;
+        _size++;
+        if (_size >= kRepeatGram) {
+            const size_t start = (_head + _size - kRepeatGram) % kRepeatWindow;
+            _keys[start] = _key;
+            _counts[_key]++;
+        }
+    }
+
+    void uncount(uint32_t key) {
+        auto it = _counts.find(key);
+        if (it != _counts.end() && --it->second == 0) {
+            _counts.erase(it);
+        }
+    }
+
+    bool repeating() const {
+        if (_size < kRepeatGram * 2) {
+            return false;
+        }
+        auto it = _counts.find(_key);
+        return it != _counts.end() && it->second > 1;
+    }
+
+    std::vector<Node> _nodes;
+    int32_t _state = 0;
+    uint32_t _phraseConfirm = 0;
+    int _confirmTokens = 0;
+    size_t _stopTrim = 0;
+
+    uint32_t _keys[kRepeatWindow];
+    size_t _head = 0;           // Oldest byte in the window
+    size_t _size = 0;
+    uint32_t _key = 0;          // Last kRepeatGram bytes
+    std::unordered_map<uint32_t, uint32_t> _counts;
+    int _repeatTokens = 0;
+};
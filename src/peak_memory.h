@@ -0,0 +1,91 @@
+/*
+ *  (c) 2025, wilddolphin2022
+ *  For WebRTCsays.ai project
+ *  https://github.com/wilddolphin2022
+ *
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the LICENSE file in the root of the source
+ *  tree. An additional intellectual property rights grant can be found
+ *  in the file PATENTS.  All contributing project authors may
+ *  be found in the AUTHORS file in the root of the source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#endif
+
+// Resident memory of this process in bytes, 0 where the platform doesn't say
+inline uint64_t residentMemoryBytes() {
+#if defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return info.resident_size;
+#elif defined(__linux__)
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size = 0;
+    uint64_t resident = 0;
+    if (!(statm >> size >> resident)) {
+        return 0;
+    }
+    return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#else
+    return 0;
+#endif
+}
+
+// Samples the process's resident memory on a thread of its own from
+// construction until stop(), for the peak over a stretch of work like a
+// model load. Mapped weights count once their pages are touched.
+class PeakMemorySampler {
+public:
+    explicit PeakMemorySampler(std::chrono::milliseconds interval = std::chrono::milliseconds(10))
+        : _peak(residentMemoryBytes()) {
+        _thread = std::thread([this, interval] {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (!_stopped) {
+                _condition.wait_for(lock, interval);
+                _peak = std::max(_peak, residentMemoryBytes());
+            }
+        });
+    }
+
+    ~PeakMemorySampler() {
+        stop();
+    }
+
+    // Highest resident size seen, including right now
+    uint64_t stop() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopped = true;
+        }
+        _condition.notify_one();
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        _peak = std::max(_peak, residentMemoryBytes());
+        return _peak;
+    }
+
+private:
+    uint64_t _peak;
+    bool _stopped = false;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::thread _thread;
+};
@@ -46,10 +46,49 @@ WhillatsTranscriber::WhillatsTranscriber(const char* model_path, WhillatsSetResp
     : _callback(callback),
       _whisper_transcriber(std::make_unique<WhisperTranscriber>(model_path, callback)) {}
 
+WhillatsTranscriber::WhillatsTranscriber(const char* model_path, const char* fast_model_path,
+                                         WhillatsSetResponseCallback callback,
+                                         WhillatsSetResponseCallback partial_callback)
+    : _callback(callback),
+      _whisper_transcriber(std::make_unique<WhisperTranscriber>(
+          model_path, callback, fast_model_path, partial_callback)) {}
+
 WhillatsTranscriber::~WhillatsTranscriber() {}
 
-void WhillatsTranscriber::processAudioBuffer(uint8_t* playoutBuffer, const size_t playoutBufferSize) {
-    _whisper_transcriber->ProcessAudioBuffer(playoutBuffer, playoutBufferSize);
+bool WhillatsTranscriber::swapModel(const char* model_path) {
+    return _whisper_transcriber->SwapModel(model_path ? model_path : "");
+}
+
+bool WhillatsTranscriber::processAudioBuffer(uint8_t* playoutBuffer, const size_t playoutBufferSize) {
+    return _whisper_transcriber->ProcessAudioBuffer(playoutBuffer, playoutBufferSize);
+}
+
+bool WhillatsTranscriber::processAudioInt16(const int16_t* samples, size_t frames, int sample_rate, int channels) {
+    return _whisper_transcriber->ProcessAudioInt16(samples, frames, sample_rate, channels);
+}
+
+bool WhillatsTranscriber::processAudioFloat(const float* samples, size_t frames, int sample_rate, int channels) {
+    return _whisper_transcriber->ProcessAudioFloat(samples, frames, sample_rate, channels);
+}
+
+bool WhillatsTranscriber::processAudioMuLaw(const uint8_t* samples, size_t frames, int sample_rate, int channels) {
+    return _whisper_transcriber->ProcessAudioMuLaw(samples, frames, sample_rate, channels);
+}
+
+WhillatsTranscriberStats WhillatsTranscriber::getStats() const {
+    return _whisper_transcriber->GetStats();
+}
+
+void WhillatsTranscriber::setAudioBudget(size_t max_samples, WhillatsOverflowPolicy policy) {
+    _whisper_transcriber->SetAudioBudget(max_samples, policy);
+}
+
+WhillatsTranscriptionQuality WhillatsTranscriber::getQuality() const {
+    return _whisper_transcriber->GetQuality();
+}
+
+void WhillatsTranscriber::setAdaptiveQuality(bool enabled, WhillatsTranscriptionQuality level) {
+    _whisper_transcriber->SetAdaptiveQuality(enabled, level);
 }
 
 bool WhillatsTranscriber::start() {
@@ -74,6 +113,95 @@ void WhillatsLlama::stop() {
     _llama_device->stop();
 } 
 
-void WhillatsLlama::askLlama(const char* prompt) {
-    _llama_device->askLlama(prompt);
+void WhillatsLlama::askLlama(const char* prompt, int priority, uint32_t deadline_ms,
+                             const WhillatsLlamaBudget& budget) {
+    _llama_device->askLlama(prompt, priority, deadline_ms, budget);
+}
+
+int WhillatsLlama::addModel(const char* model_path, uint32_t max_prompt_chars) {
+    return _llama_device->addModel(model_path, max_prompt_chars);
+}
+
+void WhillatsLlama::addRoutingKeyword(const char* keyword, int model) {
+    _llama_device->addRoutingKeyword(keyword, model);
+}
+
+void WhillatsLlama::setRouterModel(const char* model_path) {
+    _llama_device->setRouterModel(model_path);
+}
+
+void WhillatsLlama::addRouterLabel(const char* label, int model) {
+    _llama_device->addRouterLabel(label, model);
+}
+
+bool WhillatsLlama::swapModel(const char* model_path, int model) {
+    return _llama_device->swapModel(model_path, model);
+}
+
+std::vector<WhillatsLlamaModelStats> WhillatsLlama::getModelStats() const {
+    return _llama_device->getModelStats();
+}
+
+void WhillatsLlama::setSampler(const WhillatsSamplerConfig& config) {
+    _llama_device->setSampler(config);
+}
+
+void WhillatsLlama::setSegmentation(const WhillatsSegmentConfig& config) {
+    _llama_device->setSegmentation(config);
+}
+
+void WhillatsLlama::setResponseCache(size_t max_bytes, uint32_t ttl_ms) {
+    _llama_device->setResponseCache(max_bytes, ttl_ms);
+}
+
+bool WhillatsLlama::saveSession(const char* path) {
+    return _llama_device->saveSession(path);
+}
+
+bool WhillatsLlama::loadSession(const char* path) {
+    return _llama_device->loadSession(path);
+}
+
+void WhillatsLlama::cancel() {
+    _llama_device->cancel();
+}
+
+void WhillatsLlama::replace(const char* prompt) {
+    _llama_device->replace(prompt);
+}
+
+void WhillatsLlama::setConfig(const WhillatsLlamaConfig& config) {
+    _llama_device->setConfig(config);
+}
+
+void WhillatsLlama::setTokenCallback(WhillatsSetTokenCallback callback) {
+    _llama_device->setTokenCallback(callback);
+}
+
+void WhillatsLlama::setDoneCallback(WhillatsSetDoneCallback callback) {
+    _llama_device->setDoneCallback(callback);
+}
+
+void WhillatsLlama::setSystemPrompt(const char* prompt) {
+    _llama_device->setSystemPrompt(prompt);
+}
+
+void WhillatsLlama::setStopStrings(const std::vector<std::string>& stops) {
+    _llama_device->setStopStrings(stops);
+}
+
+void WhillatsLlama::setDraftModel(const char* model_path) {
+    _llama_device->setDraftModel(model_path);
+}
+
+void WhillatsLlama::setSpeculativeMode(WhillatsSpeculativeMode mode) {
+    _llama_device->setSpeculativeMode(mode);
+}
+
+void WhillatsLlama::resetConversation() {
+    _llama_device->resetConversation();
+}
+
+WhillatsLlamaStats WhillatsLlama::getStats() const {
+    return _llama_device->getStats();
 }
\ No newline at end of file
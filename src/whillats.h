@@ -16,6 +16,7 @@
 #include "whillats_export.h"
 #include <cstdint>
 #include <cstring>
+#include <string>
 #include <vector>
 #include <memory>
 
@@ -23,6 +24,34 @@
 typedef void (*ResponseCallback)(bool success, const char* response, void* user_data);
 typedef void (*AudioCallback)(bool success, const uint16_t* buffer, size_t buffer_size, void* user_data);
 
+// One generated token, as streamed by WhillatsLlama
+struct WhillatsLlamaToken {
+    const char* text;       // Token piece, a multi-byte character may span pieces
+    uint32_t index;         // Position in the response, from 0
+    double time_ms;         // Since the prompt was taken up
+    double interval_ms;     // Since the previous token, time to first token for index 0
+};
+
+typedef void (*TokenCallback)(const WhillatsLlamaToken* token, void* user_data);
+
+// Why an answer ended
+enum class WhillatsLlamaStopReason {
+    EndOfGeneration,    // The model finished
+    StopString,         // One of the stop strings came up
+    Repetition,         // The model kept repeating itself
+    Confirmation,       // Filler like "yeah, okay, right" piled up
+    TokenBudget,        // Wrapped up at the request's token budget
+    TimeBudget,         // Wrapped up at the request's time budget
+    ContextFull,        // The dialogue ran out of KV cache room
+    Cancelled,          // cancel() or replace()
+    Expired,            // Still queued at its deadline, never started
+    Cached,             // Replayed from the response cache
+    Error               // Decoding failed
+};
+
+// Called once per prompt after its last response callback, with the whole answer
+typedef void (*DoneCallback)(WhillatsLlamaStopReason reason, const char* response, void* user_data);
+
 class WHILLATS_API WhillatsSetResponseCallback {
 public:
     WhillatsSetResponseCallback(ResponseCallback callback, void* user_data)
@@ -39,6 +68,40 @@ private:
     void* user_data_;
 };
 
+class WHILLATS_API WhillatsSetTokenCallback {
+public:
+    WhillatsSetTokenCallback(TokenCallback callback = nullptr, void* user_data = nullptr)
+        : callback_(callback), user_data_(user_data) {}
+
+    void OnToken(const WhillatsLlamaToken& token) {
+        if (callback_) {
+            callback_(&token, user_data_);
+        }
+    }
+
+    bool enabled() const { return callback_ != nullptr; }
+
+private:
+    TokenCallback callback_;
+    void* user_data_;
+};
+
+class WHILLATS_API WhillatsSetDoneCallback {
+public:
+    WhillatsSetDoneCallback(DoneCallback callback = nullptr, void* user_data = nullptr)
+        : callback_(callback), user_data_(user_data) {}
+
+    void OnDone(WhillatsLlamaStopReason reason, const char* response) {
+        if (callback_) {
+            callback_(reason, response, user_data_);
+        }
+    }
+
+private:
+    DoneCallback callback_;
+    void* user_data_;
+};
+
 class WHILLATS_API WhillatsSetAudioCallback {
 public:
     WhillatsSetAudioCallback(AudioCallback callback, void* user_data)
@@ -55,6 +118,201 @@ private:
     void* user_data_;
 };
 
+// What the transcriber does with new audio once its per-session budget is full
+enum class WhillatsOverflowPolicy {
+    DropOldest,     // Discard just enough of the oldest buffered audio
+    SkipToLatest,   // Discard everything buffered and continue from the new audio
+    RefuseInput     // Reject the new audio, processAudioBuffer() returns false
+};
+
+// Transcription quality ladder, stepped down under load and back up when it
+// eases. Minimal uses the fast model for finals when one is configured.
+enum class WhillatsTranscriptionQuality {
+    Best,       // Beam search, full audio context
+    Default,    // Greedy, audio_ctx 768, 128 tokens
+    Reduced,    // Greedy, audio_ctx 512, 64 tokens
+    Minimal     // Greedy, audio_ctx 384, 32 tokens, no partials
+};
+
+// Transcriber latency and load report. Partial figures are only populated
+// when a fast model is configured.
+struct WhillatsTranscriberStats {
+    double partial_latency_ms = 0;      // Last fast-model pass over the streaming window
+    double partial_latency_avg_ms = 0;
+    double final_latency_ms = 0;        // Last endpoint-to-final-transcript delay
+    double final_latency_avg_ms = 0;
+    uint64_t partials = 0;
+    uint64_t finals = 0;
+
+    double lag_ms = 0;                  // Audio accepted but not yet transcribed
+    uint64_t dropped_samples = 0;       // Discarded by DropOldest/SkipToLatest
+    uint64_t refused_samples = 0;       // Rejected by RefuseInput
+    uint64_t overflow_events = 0;
+
+    WhillatsTranscriptionQuality quality = WhillatsTranscriptionQuality::Default;
+    double real_time_factor = 0;        // Smoothed processing time / audio duration
+    uint64_t quality_changes = 0;
+
+    uint64_t model_swaps = 0;           // swapModel() calls that took effect
+    double model_swap_ms = 0;           // Last one, loading and switching
+    uint64_t model_swap_peak_bytes = 0; // Process resident memory, highest sampled during the swap
+};
+
+// Element type of the LLM's KV cache. Quantized caches hold more sessions per
+// host at a small cost in quality, a quantized V cache needs flash attention.
+enum class WhillatsKVCacheType {
+    F16,
+    Q8_0,           // About half of F16
+    Q4_0            // About a quarter of F16
+};
+
+// LLM context setup. Every WhillatsLlama on the same model path shares one
+// context, the first to start sizes it.
+struct WhillatsLlamaConfig {
+    uint32_t n_ctx = 8192;          // KV cells, shared by all sessions on the model
+    uint32_t n_batch = 512;         // Logical batch, tokens per decode step
+    uint32_t n_ubatch = 512;        // Physical batch, at most n_batch
+    uint32_t n_seq_max = 16;        // Sessions plus resident system prompts
+    uint32_t session_ctx = 2048;    // Dialogue tokens kept per session
+    uint32_t prefill_chunk = 256;   // Least prompt tokens a session prefills per step
+    WhillatsKVCacheType type_k = WhillatsKVCacheType::F16;
+    WhillatsKVCacheType type_v = WhillatsKVCacheType::F16;
+    bool flash_attn = false;
+
+    // Model loading, for the first session on a model. Later sessions share
+    // the resident model and start without loading anything.
+    bool use_mmap = true;           // Map the weights instead of reading them in
+    bool use_mlock = false;         // Pin the weights in RAM, no paging out between calls
+    bool warmup = false;            // Fault the weights in and run one decode in the background
+};
+
+// Limits for one answer. Near a limit the answer wraps up at the next clause
+// or sentence end rather than stopping mid phrase, at the limit it stops.
+struct WhillatsLlamaBudget {
+    uint32_t max_tokens = 256;      // 0 for no limit but the context
+    uint32_t max_time_ms = 0;       // From taking up the prompt, 0 for no limit
+    uint32_t wrap_up_tokens = 32;   // Start wrapping up this close to max_tokens
+    uint32_t wrap_up_ms = 800;      // And this close to max_time_ms
+};
+
+// How the LLM's answer is cut into the pieces handed to the response
+// callback, sized for speech synthesis. Sentence ends always cut. Past that a
+// segment needs min_chars, and is cut at a clause boundary, at max_chars or
+// after max_delay_ms without output, whichever comes first. The last two
+// cut at a word boundary. 0 turns a limit off.
+struct WhillatsSegmentConfig {
+    bool clauses = true;            // Also cut after , ; : and dashes
+    uint32_t min_chars = 16;
+    uint32_t max_chars = 160;
+    uint32_t max_delay_ms = 600;    // Since the last cut
+};
+
+// How the LLM picks each token from the model's output
+enum class WhillatsSamplerMode {
+    MinP,           // Drop tokens under min_p of the top one, then temperature
+    TopKTopP,       // top_k, then the top_p nucleus, then temperature
+    Greedy          // Always the most likely token, no sorting or softmax at all
+};
+
+// Sampler settings, per WhillatsLlama. The same seed and dialogue give the
+// same answer, the default seed picks a random one per session.
+struct WhillatsSamplerConfig {
+    WhillatsSamplerMode mode = WhillatsSamplerMode::MinP;
+    float temperature = 0.8f;
+    float min_p = 0.05f;
+    int32_t top_k = 40;
+    float top_p = 0.95f;
+    uint32_t seed = 0xFFFFFFFF;     // Random
+};
+
+// How the LLM proposes tokens for the target model to verify in one decode
+enum class WhillatsSpeculativeMode {
+    None,           // One token per decode
+    DraftModel,     // A small model set with setDraftModel() drafts ahead
+    PromptLookup    // Continuations of earlier matches of the last tokens in the dialogue
+};
+
+// LLM session report, times in milliseconds
+struct WhillatsLlamaStats {
+    // Request queue
+    uint32_t queue_depth = 0;           // Prompts waiting right now
+    double queue_wait_ms = 0;           // Last prompt, from askLlama() to pickup
+    double queue_wait_avg_ms = 0;
+    double queue_wait_max_ms = 0;
+    uint64_t requests_expired = 0;      // Dropped for passing their deadline in the queue
+
+    // Output segmentation, latency from a segment's first token to its delivery
+    uint64_t segments = 0;
+    double segment_chars_avg = 0;
+    double segment_latency_ms = 0;      // Last segment
+    double segment_latency_avg_ms = 0;
+    double segment_latency_max_ms = 0;
+
+    // Response cache, ttft_ms is the replay time on a hit
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t cache_evictions = 0;       // Pushed out by the memory budget
+    uint64_t cache_entries = 0;
+    uint64_t cache_bytes = 0;
+
+    // Model routing, see WhillatsLlama::addModel()
+    int32_t route_model = 0;            // Model that answered the last prompt
+    double route_ms = 0;                // Deciding it
+    uint64_t routed_turns = 0;          // Answered by a model other than the main one
+
+    double model_load_ms = 0;           // Loading the shared model, paid by its first session
+    double model_acquire_ms = 0;        // This session's wait for the model, near 0 when resident
+    double model_warmup_ms = 0;         // Background warm-up, 0 until it is done
+    uint64_t model_swaps = 0;           // swapModel() calls that took effect
+    double model_swap_ms = 0;           // Last one, from the call until prompts go to the new model
+    uint64_t model_swap_peak_bytes = 0; // Process resident memory, highest sampled during the swap
+    uint64_t sessions_started = 0;
+    double session_start_ms = 0;        // Last session start, restoring the system prompt prefix
+    double prefix_prefill_ms = 0;       // What prefilling the prefix costs without the snapshot
+    double prefix_saved_ms = 0;         // Total time saved by restoring instead of prefilling
+
+    uint64_t turns = 0;
+    double ttft_ms = 0;                 // Last time to first token
+    double inter_token_ms = 0;          // Last turn's average time between tokens
+    WhillatsLlamaStopReason stop_reason = WhillatsLlamaStopReason::EndOfGeneration;   // Last turn
+    uint64_t budget_stops = 0;          // Turns ended by their token or time budget
+    double sample_us = 0;               // Last turn's sampling time per token
+    double sample_us_avg = 0;
+
+    // Speculative decoding
+    uint64_t draft_tokens = 0;          // Proposed for verification
+    uint64_t draft_accepted = 0;        // Kept by the target model
+    double draft_acceptance = 0;        // draft_accepted / draft_tokens
+    double tokens_per_step = 0;         // Last turn's tokens per target decode, 1 without speculation
+    uint64_t prefill_tokens = 0;        // Last turn's prefill
+    double prefill_ms = 0;              // Last turn's prefill, from the prompt to its logits
+    double prefill_tokens_per_s = 0;
+    uint64_t context_tokens = 0;        // Dialogue tokens in the KV cache
+    uint64_t kv_bytes_per_token = 0;    // KV cache memory per token at the configured types
+    uint64_t kv_session_bytes = 0;      // This session's share, its context_tokens
+    uint64_t kv_total_bytes = 0;        // The whole shared cache, n_ctx cells
+    double session_save_ms = 0;         // Last saveSession()
+    double session_restore_ms = 0;      // Last loadSession(), compare with prefill_ms
+    uint64_t session_file_bytes = 0;    // Size of the last saved or loaded session
+    uint64_t cancellations = 0;         // Turns cut short by cancel() or replace()
+    uint64_t context_shifts = 0;        // Oldest turns dropped in place when the window filled
+    double context_shift_ms = 0;        // Last shift
+
+    // Shared engine, all sessions on the same model decode in one batch
+    uint32_t engine_active_jobs = 0;    // Sessions prefilling or generating right now
+    double engine_tokens_per_s = 0;     // Aggregate decode throughput
+    double engine_batch_jobs_avg = 0;   // Sessions per decode step
+};
+
+// Per hosted model, in the order of WhillatsLlama::addModel()
+struct WhillatsLlamaModelStats {
+    std::string model_path;
+    uint64_t turns = 0;
+    double ttft_ms = 0;                 // Last turn
+    double ttft_avg_ms = 0;
+    double inter_token_ms = 0;          // Last turn
+};
+
 class ESpeakTTS;
 class WhisperTranscriber;
 class LlamaDeviceBase;
@@ -78,11 +336,38 @@ class WHILLATS_API WhillatsTTS {
 class WHILLATS_API WhillatsTranscriber {
   public:
     WhillatsTranscriber(const char* model_path, WhillatsSetResponseCallback callback);
+    // Two-tier mode: fast_model_path produces partial hypotheses on the streaming
+    // window via partial_callback, model_path produces the final transcript once
+    // per endpointed utterance via callback.
+    WhillatsTranscriber(const char* model_path, const char* fast_model_path,
+                        WhillatsSetResponseCallback callback,
+                        WhillatsSetResponseCallback partial_callback);
     ~WhillatsTranscriber();
 
     bool start();
     void stop();
-    void processAudioBuffer(uint8_t* playoutBuffer, const size_t playoutBufferSize);
+    // Returns false if the audio was refused because the session is over budget
+    bool processAudioBuffer(uint8_t* playoutBuffer, const size_t playoutBufferSize);
+
+    // Typed ingest, frames are interleaved across channels. Audio is decoded,
+    // downmixed and resampled to 16 kHz mono in one pass into the session buffer.
+    bool processAudioInt16(const int16_t* samples, size_t frames, int sample_rate, int channels);
+    bool processAudioFloat(const float* samples, size_t frames, int sample_rate, int channels);
+    bool processAudioMuLaw(const uint8_t* samples, size_t frames, int sample_rate, int channels);
+    WhillatsTranscriberStats getStats() const;
+
+    // Hard cap on audio held per session, in 16 kHz samples, 0 for no cap
+    void setAudioBudget(size_t max_samples, WhillatsOverflowPolicy policy);
+
+    // Quality currently in use. Adaptive stepping is on by default, disabling
+    // it pins the given level.
+    WhillatsTranscriptionQuality getQuality() const;
+    void setAdaptiveQuality(bool enabled, WhillatsTranscriptionQuality level = WhillatsTranscriptionQuality::Default);
+
+    // Loads model_path in the background and moves final transcripts to it,
+    // a transcription in progress finishes on the old model, which is freed
+    // after it. Returns false while an earlier swap is still loading.
+    bool swapModel(const char* model_path);
 
   private:
     WhillatsSetResponseCallback _callback; 
@@ -96,7 +381,73 @@ class WHILLATS_API WhillatsLlama {
 
     bool start();
     void stop();
-    void askLlama(const char* prompt);
+    // Queue a prompt. Higher priority prompts are answered first, equal ones
+    // in order. With a deadline_ms the prompt is dropped if it hasn't started
+    // by then, reported as an unsuccessful response. budget limits the answer.
+    void askLlama(const char* prompt, int priority = 0, uint32_t deadline_ms = 0,
+                  const WhillatsLlamaBudget& budget = WhillatsLlamaBudget());
+    // Barge-in. Drops queued prompts and stops the answer in progress at its
+    // next token, the dialogue goes back to the last completed turn.
+    void cancel();
+    // cancel(), then ask prompt right away
+    void replace(const char* prompt);
+    // Context and batch sizes, call before start()
+    void setConfig(const WhillatsLlamaConfig& config);
+    // Optional, streams every token as it is sampled. Sentences still go to
+    // the response callback.
+    void setTokenCallback(WhillatsSetTokenCallback callback);
+    // Optional, tells why each answer ended
+    void setDoneCallback(WhillatsSetDoneCallback callback);
+    // How tokens are picked, applies from the next prompt
+    void setSampler(const WhillatsSamplerConfig& config);
+
+    // The system prompt is prefilled once per model and reused by every
+    // session. Takes effect at the next session start.
+    void setSystemPrompt(const char* prompt);
+    // Strings that end a response early, like a turn marker the model leaks.
+    // Matched case-insensitively and cut from the text.
+    void setStopStrings(const std::vector<std::string>& stops);
+    // How answers are cut for the response callback, applies from the next prompt
+    void setSegmentation(const WhillatsSegmentConfig& config);
+    // Speculative decoding. The draft model must share the vocabulary and is
+    // loaded at start(), the mode can change between prompts.
+    void setDraftModel(const char* model_path);
+    void setSpeculativeMode(WhillatsSpeculativeMode mode);
+    // Forget the dialogue and start a new session from the system prompt
+    void resetConversation();
+    // Optional cache of answers by prompt, for questions asked again and
+    // again. A hit needs the same prompt up to case, punctuation and spacing,
+    // the same dialogue before it and the same settings, and replays the
+    // answer through the callbacks without generating. Off with max_bytes 0,
+    // entries never expire with ttl_ms 0.
+    void setResponseCache(size_t max_bytes, uint32_t ttl_ms);
+    // Persist the dialogue with its KV cache, so a transferred or reconnected
+    // call resumes without prefilling the history again. Both wait for the
+    // answer in progress. Loading fails if the file was saved with another
+    // model or doesn't fit the context.
+    bool saveSession(const char* path);
+    bool loadSession(const char* path);
+    WhillatsLlamaStats getStats() const;
+
+    // Routing. Models added before start() share the dialogue with the main
+    // model, each prompt goes to one of them. Returns the model's index, the
+    // main model is 0. Prompts up to max_prompt_chars go to the model unless
+    // a keyword or the router model decides otherwise, 0 for no length rule.
+    int addModel(const char* model_path, uint32_t max_prompt_chars = 0);
+    // Prompts with keyword in them, as a word and up to case, go to model
+    void addRoutingKeyword(const char* keyword, int model);
+    // A tiny model that labels prompts, on a small context of its own. Each
+    // label goes to a model, without any "simple" goes to model 1 and
+    // "complex" to model 0. Labels should start with different words.
+    void setRouterModel(const char* model_path);
+    void addRouterLabel(const char* label, int model);
+    std::vector<WhillatsLlamaModelStats> getModelStats() const;
+    // Loads model_path in the background to replace a hosted model, the main
+    // one by default. The dialogue carries over at the next prompt, a turn in
+    // progress finishes on the old model. Other sessions on the old model
+    // keep it until they stop, sessions started later get the new one.
+    // Returns false if not started or a swap is still loading.
+    bool swapModel(const char* model_path, int model = 0);
   private:
     WhillatsSetResponseCallback _callback;
     std::unique_ptr<LlamaDeviceBase> _llama_device;
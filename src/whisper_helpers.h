@@ -18,6 +18,7 @@
 #include <cctype>
 #include <locale>
 #include <string>
+#include <cstring>
 #include <sstream>
 #include <chrono>
 #include <iostream>
@@ -84,14 +85,31 @@ private:
 template<typename T>
 class AudioRingBuffer {
 public:
-    AudioRingBuffer(size_t size) 
+    AudioRingBuffer(size_t size, size_t maxSize = 0) 
         : _buffer(size)
         , _writePos(0)
         , _readPos(0)
-        , _available(0) {}
+        , _available(0)
+        , _maxSize(maxSize) {}
 
+    // Returns false without writing anything if the data would push the
+    // buffered amount over maxSize.
     bool write(const T* data, size_t size) {
+        return writeWith(size, [&data](T* dst, size_t count) {
+            std::memcpy(dst, data, count * sizeof(T));
+            data += count;
+        });
+    }
+
+    // Like write(), but lets the caller produce the samples in place:
+    // fill(dst, count) is called once, or twice when the write wraps around.
+    template <typename Fill>
+    bool writeWith(size_t size, Fill fill) {
         std::lock_guard<std::mutex> lock(_mutex);
+
+        if (_maxSize > 0 && _available + size > _maxSize) {
+            return false;
+        }
         
         // If buffer is too small, resize it
         if (size > (_buffer.size() - _available)) {
@@ -99,7 +117,10 @@ public:
             while (size > (newSize - _available)) {
                 newSize *= 2;  // Keep doubling until we have enough space
             }
-            
+            if (_maxSize > 0) {
+                // Never allocate past the budget, it already covers _available + size
+                newSize = std::max(std::min(newSize, _maxSize), _buffer.size());
+            }
             LOG_V("Resizing ring buffer from " << _buffer.size() << " to " << newSize << " samples");
             
             // Create new buffer with larger size
@@ -126,11 +147,13 @@ public:
 
         // Now write the new data
         size_t firstWrite = std::min(size, _buffer.size() - _writePos);
-        std::memcpy(&_buffer[_writePos], data, firstWrite * sizeof(T));
+        if (firstWrite > 0) {
+            fill(&_buffer[_writePos], firstWrite);
+        }
 
         if (firstWrite < size) {
             // Wrap around
-            std::memcpy(&_buffer[0], data + firstWrite, (size - firstWrite) * sizeof(T));
+            fill(&_buffer[0], size - firstWrite);
         }
 
         _writePos = (_writePos + size) % _buffer.size();
@@ -158,11 +181,26 @@ public:
         return true;
     }
 
+    // Drop up to size of the oldest samples, returns how many were dropped
+    size_t discard(size_t size) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        size = std::min(size, _available);
+        _readPos = (_readPos + size) % _buffer.size();
+        _available -= size;
+        return size;
+    }
+
     size_t availableToRead() const {
         std::lock_guard<std::mutex> lock(_mutex);
         return _available;
     }
 
+    // Cap on buffered samples, 0 means unbounded
+    void setMaxSize(size_t maxSize) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _maxSize = maxSize;
+    }
+
     void increaseWith(size_t additionalSize) {
         std::lock_guard<std::mutex> lock(_mutex);
         _buffer.resize(_buffer.size() + additionalSize);
@@ -185,6 +223,7 @@ private:
     size_t _writePos;
     size_t _readPos;
     size_t _available;
+    size_t _maxSize;
     mutable std::mutex _mutex;
 };
 
@@ -249,3 +288,23 @@ inline void rtrim(std::string &s) {
     }).base(), s.end());
 }
 
+// Lowercase, with runs of whitespace and punctuation as single spaces, so
+// "What are your hours?" and "what are your  hours" compare equal while
+// "2+2" and "22" don't
+inline std::string normalizeText(const std::string &text) {
+    std::string out;
+    out.reserve(text.size());
+    for (char ch : text) {
+        const unsigned char c = static_cast<unsigned char>(ch);
+        if (std::isalnum(c) || c >= 0x80) {
+            out += static_cast<char>(std::tolower(c));
+        } else if (!out.empty() && out.back() != ' ') {
+            out += ' ';
+        }
+    }
+    while (!out.empty() && out.back() == ' ') {
+        out.pop_back();
+    }
+    return out;
+}
+
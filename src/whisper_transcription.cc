@@ -26,6 +26,7 @@
 #include <whisper.h>
 #include "whisper_transcription.h"
 #include "whisper_helpers.h"
+#include "peak_memory.h"
 
 bool WhisperTranscriber::vad_simple(
         const std::vector<float>& pcmf32,
@@ -153,28 +154,61 @@ void WhisperTranscriber::fft_forward(std::vector<std::complex<float>>& data, int
 
 WhisperTranscriber::WhisperTranscriber(
     const char* model_path,
-    WhillatsSetResponseCallback callback) 
+    WhillatsSetResponseCallback callback,
+    const char* fast_model_path,
+    WhillatsSetResponseCallback partial_callback) 
     : _model_path(model_path),
+      _fast_model_path(fast_model_path ? fast_model_path : ""),
       _responseCallback(callback),
-      _whisperContext(nullptr),
+      _partialCallback(partial_callback),
+      _fastWhisperContext(nullptr),
       _running(false),
       _processingActive(false),
-      _audioBuffer(new AudioRingBuffer<float>(kRingBufferSizeIncrement))
+      _audioBudgetSamples(kDefaultAudioBudgetSamples),
+      _overflowPolicy(WhillatsOverflowPolicy::DropOldest),
+      _utteranceSamples(0),
+      _qualityLevel(static_cast<int>(WhillatsTranscriptionQuality::Default)),
+      _adaptiveQuality(true),
+      _audioBuffer(new AudioRingBuffer<float>(kRingBufferSizeIncrement, kDefaultAudioBudgetSamples))
 {
     // Initialize Whisper context
     if (!InitializeWhisperModel(_model_path) || !_whisperContext) {
         LOG_E("Failed to initialize Whisper model");
-        _whisperContext = TryAlternativeInitMethods(_model_path);
-        if (!_whisperContext) {
+        whisper_context* context = TryAlternativeInitMethods(_model_path);
+        if (context) {
+            _whisperContext.reset(context, whisper_free);
+        } else {
             LOG_E("Failed to initialize Whisper model alternative ways");
         }
     }
+
+    // The fast model is optional, without it we run single-tier
+    if (!_fast_model_path.empty()) {
+        _fastWhisperContext = whisper_init_from_file_with_params(
+            _fast_model_path.c_str(), whisper_context_default_params());
+        if (!_fastWhisperContext) {
+            LOG_W("Failed to load fast Whisper model " << _fast_model_path << ", partials disabled");
+        } else {
+            LOG_I("Fast Whisper model loaded: " << _fast_model_path);
+        }
+    }
 }
 
 WhisperTranscriber::~WhisperTranscriber() {
     stop();
-    if (_whisperContext) {
-        whisper_free(_whisperContext);
+    std::thread swapThread;
+    {
+        std::lock_guard<std::mutex> lock(_swapMutex);
+        swapThread = std::move(_swapThread);
+    }
+    if (swapThread.joinable()) {
+        swapThread.join();
+    }
+    if (_fastFinalState) {
+        whisper_free_state(_fastFinalState);
+    }
+    if (_fastWhisperContext) {
+        whisper_free(_fastWhisperContext);
     }
 }
 
@@ -236,7 +270,7 @@ bool WhisperTranscriber::InitializeWhisperModel(const std::string& modelPath) {
         );
 
         if (localContext) {
-            _whisperContext = localContext;
+            _whisperContext.reset(localContext, whisper_free);
             LOG_I("Model loaded successfully (GPU: " << (useGpu ? "Enabled" : "Disabled") << ")");
             return true;
         }
@@ -286,13 +320,45 @@ bool WhisperTranscriber::ValidateWhisperModel(const std::string& modelPath) {
     return true;
 }
 
-// Transcribe audio non-blocking 
-bool WhisperTranscriber::TranscribeAudioNonBlocking(const std::vector<float>& pcmf32) {
-    if (!_whisperContext) {
-        LOG_E("Whisper context not initialized");
-        return false;
+// Finals follow the current quality level, partials always run cheap
+const WhisperTranscriber::QualityLevel WhisperTranscriber::kQualityLevels[] = {
+    { true,  0,   128, false },  // Best
+    { false, 768, 128, false },  // Default
+    { false, 512, 64,  false },  // Reduced
+    { false, 384, 32,  true  },  // Minimal
+};
+
+whisper_full_params WhisperTranscriber::BuildParams(bool partial) const {
+    const QualityLevel& level = kQualityLevels[_qualityLevel];
+
+    // Set up whisper parameters
+    whisper_full_params wparams = whisper_full_default_params(
+        !partial && level.beam ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+    if (!partial && level.beam) {
+        wparams.beam_search.beam_size = 5;
     }
+    
+    // Basic parameters for better results
+    wparams.print_progress   = !partial;
+    wparams.print_timestamps = !partial;
+    wparams.translate        = false;
+    wparams.no_context      = partial;   // Partials must not leak into the final's context
+    wparams.single_segment  = true;      // Process as single segment
+    wparams.duration_ms     = 0;         // Process all available audio
+    wparams.max_tokens      = partial ? 32 : level.max_tokens;
+    wparams.language        = "en";
+    wparams.n_threads       = kThreadsPerState;
+    wparams.audio_ctx       = partial ? 512 : level.audio_ctx;
+    wparams.suppress_blank  = true;      // Suppress blank outputs
+    return wparams;
+}
 
+// Run one whisper pass over pcmf32 and collect its segments. With a null
+// state the context's default state is used.
+bool WhisperTranscriber::RunWhisper(whisper_context* ctx, whisper_state* state,
+                                    const whisper_full_params& wparams,
+                                    const std::vector<float>& pcmf32,
+                                    std::vector<TranscriptSegment>& segments) {
     LOG_V("Starting transcription of " << pcmf32.size() << " samples");
 
     // Ensure minimum duration of 1 second with proper padding
@@ -308,7 +374,7 @@ bool WhisperTranscriber::TranscribeAudioNonBlocking(const std::vector<float>& pc
     // Add padding if needed
     if (padded_audio.size() < min_samples) {
         size_t padding_needed = min_samples - padded_audio.size();
-        LOG_I("Padding audio with " << padding_needed << " samples of silence");
+        LOG_V("Padding audio with " << padding_needed << " samples of silence");
         
         // Add silence after the audio
         padded_audio.insert(padded_audio.end(), padding_needed, 0.0f);
@@ -316,62 +382,265 @@ bool WhisperTranscriber::TranscribeAudioNonBlocking(const std::vector<float>& pc
 
     LOG_V("Final audio size for transcription: " << padded_audio.size() << " samples");
 
-    // Set up whisper parameters
-    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-    
-    // Basic parameters for better results
-    wparams.print_progress   = true;
-    wparams.print_timestamps = true;
-    wparams.translate        = false;
-    wparams.no_context      = false;     // Allow context
-    wparams.single_segment  = true;      // Process as single segment
-    wparams.duration_ms     = 0;         // Process all available audio
-    wparams.max_tokens      = 128;       // Increased token limit
-    wparams.language        = "en";
-    wparams.n_threads       = 4;
-    wparams.audio_ctx       = 768;       // Default audio context
-    wparams.suppress_blank  = true;      // Suppress blank outputs
-
     // Process audio with whisper
-    int result = whisper_full(_whisperContext, wparams, padded_audio.data(), padded_audio.size());
+    int result = state
+        ? whisper_full_with_state(ctx, state, wparams, padded_audio.data(), padded_audio.size())
+        : whisper_full(ctx, wparams, padded_audio.data(), padded_audio.size());
     if (result != 0) {
         LOG_E("Whisper processing failed with code: " << result);
         return false;
     }
 
-    // Get transcription result
-    const int n_segments = whisper_full_n_segments(_whisperContext);
+    // Get transcription result, whisper timestamps are in 10 ms units
+    const int n_segments = state ? whisper_full_n_segments_from_state(state) : whisper_full_n_segments(ctx);
     LOG_V("Whisper found " << n_segments << " segments");
 
-    if (n_segments > 0) {
-        std::string full_text;
-        for (int i = 0; i < n_segments; ++i) {
-            const char* segment_text = whisper_full_get_segment_text(_whisperContext, i);
-            LOG_V("Segment " << i << " text: " << (segment_text ? segment_text : "null"));
-            
-            if (segment_text && strlen(segment_text) > 0) {
-                if (!full_text.empty()) {
-                    full_text += " ";
-                }
-                full_text += segment_text;
-            }
+    segments.clear();
+    for (int i = 0; i < n_segments; ++i) {
+        const char* segment_text = state
+            ? whisper_full_get_segment_text_from_state(state, i)
+            : whisper_full_get_segment_text(ctx, i);
+        LOG_V("Segment " << i << " text: " << (segment_text ? segment_text : "null"));
+        
+        if (segment_text && strlen(segment_text) > 0) {
+            TranscriptSegment segment;
+            segment.t0_ms = state ? whisper_full_get_segment_t0_from_state(state, i) * 10 : whisper_full_get_segment_t0(ctx, i) * 10;
+            segment.t1_ms = state ? whisper_full_get_segment_t1_from_state(state, i) * 10 : whisper_full_get_segment_t1(ctx, i) * 10;
+            segment.text = segment_text;
+            segments.push_back(std::move(segment));
         }
+    }
 
-        if (!full_text.empty()) {
-            std::cout << "Transcribed: " << full_text << std::endl;
-            _responseCallback.OnResponseComplete(true, full_text.c_str());
-            return true;
+    return !segments.empty();
+}
+
+std::string WhisperTranscriber::JoinSegments(const std::vector<TranscriptSegment>& segments) {
+    std::string text;
+    for (const auto& segment : segments) {
+        if (!text.empty()) {
+            text += " ";
+        }
+        text += segment.text;
+    }
+    return text;
+}
+
+// Transcribe audio non-blocking 
+bool WhisperTranscriber::TranscribeAudioNonBlocking(const std::vector<float>& pcmf32) {
+    const std::shared_ptr<whisper_context> model = Model();
+    if (!model) {
+        LOG_E("Whisper context not initialized");
+        return false;
+    }
+
+    // At the lowest quality level finals move to the fast model, on their own state
+    whisper_context* ctx = model.get();
+    whisper_state* state = nullptr;
+    if (kQualityLevels[_qualityLevel].fast_model && _fastWhisperContext) {
+        if (!_fastFinalState) {
+            _fastFinalState = whisper_init_state(_fastWhisperContext);
+        }
+        if (_fastFinalState) {
+            ctx = _fastWhisperContext;
+            state = _fastFinalState;
         }
     }
 
+    auto start = std::chrono::steady_clock::now();
+    std::vector<TranscriptSegment> segments;
+    bool produced = RunWhisper(ctx, state, BuildParams(false), pcmf32, segments);
+    RecordRealTimeFactor(pcmf32.size(), std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count());
+
+    if (produced) {
+        std::string full_text = JoinSegments(segments);
+        std::cout << "Transcribed: " << full_text << std::endl;
+        _responseCallback.OnResponseComplete(true, full_text.c_str());
+        return true;
+    }
+
     LOG_W("No transcription result produced");
     return false;
 }
 
-void WhisperTranscriber::ProcessAudioBuffer(uint8_t* playoutBuffer, size_t kPlayoutBufferSize) {
-    if(_whisperContext == nullptr) {
+// Chunk boundaries for a long buffer, cut in the middle of silences.
+// Each chunk is [first, second) in samples.
+std::vector<std::pair<size_t, size_t>> WhisperTranscriber::SplitAtSilences(std::vector<float>& pcmf32) const {
+    // samples = 1 keeps the silence regions in sample units
+    SilenceFinder<float> silenceFinder(pcmf32.data(), pcmf32.size(), 1);
+    auto silences = silenceFinder.find(0.1f, kSampleRate / 10);
+
+    std::vector<size_t> cuts;
+    for (const auto& region : silences) {
+        cuts.push_back((region.first + region.second) / 2);
+    }
+
+    std::vector<std::pair<size_t, size_t>> chunks;
+    size_t start = 0;
+    size_t next = 0;
+    while (pcmf32.size() - start > kChunkMaxSamples) {
+        // Pick the silence closest to the target length, hard cut if there is none
+        size_t cut = start + kChunkMaxSamples;
+        size_t best = kChunkMaxSamples;
+        for (size_t i = next; i < cuts.size() && cuts[i] <= start + kChunkMaxSamples; ++i) {
+            if (cuts[i] < start + kChunkMinSamples) {
+                continue;
+            }
+            const size_t length = cuts[i] - start;
+            const size_t distance = length > kChunkTargetSamples ? length - kChunkTargetSamples
+                                                                 : kChunkTargetSamples - length;
+            if (distance < best) {
+                best = distance;
+                cut = cuts[i];
+            }
+        }
+        chunks.push_back(std::make_pair(start, cut));
+        start = cut;
+        while (next < cuts.size() && cuts[next] <= start) {
+            ++next;
+        }
+    }
+    chunks.push_back(std::make_pair(start, pcmf32.size()));
+    return chunks;
+}
+
+// Transcribe a long buffer as independent chunks on several whisper states,
+// then stitch the segments back in order on the recording's timeline.
+bool WhisperTranscriber::TranscribeParallel(std::vector<float>& pcmf32) {
+    auto start = std::chrono::steady_clock::now();
+    const auto chunks = SplitAtSilences(pcmf32);
+
+    const int hardware = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    const int n_workers = std::min(static_cast<int>(chunks.size()),
+                                   std::min(kMaxParallelStates, std::max(1, hardware / kThreadsPerState)));
+    if (n_workers < 2) {
+        return TranscribeAudioNonBlocking(pcmf32);
+    }
+
+    LOG_I("Transcribing " << pcmf32.size() << " samples as " << chunks.size()
+          << " chunks on " << n_workers << " whisper states");
+
+    whisper_full_params wparams = BuildParams(false);
+    wparams.print_progress   = false;
+    wparams.print_timestamps = false;
+    wparams.single_segment   = false;   // Keep per-segment timestamps inside a chunk
+    wparams.no_context       = true;    // Chunks are independent
+
+    const std::shared_ptr<whisper_context> model = Model();
+    std::vector<std::vector<TranscriptSegment>> results(chunks.size());
+    std::vector<char> done(chunks.size(), 0);  // Not vector<bool>, workers write concurrently
+    std::atomic<size_t> nextChunk(0);
+
+    auto transcribeChunk = [&](whisper_state* state, size_t i) {
+        std::vector<float> chunk(pcmf32.begin() + chunks[i].first, pcmf32.begin() + chunks[i].second);
+        RunWhisper(model.get(), state, wparams, chunk, results[i]);
+
+        const int64_t offset_ms = static_cast<int64_t>(chunks[i].first) * 1000 / kSampleRate;
+        for (auto& segment : results[i]) {
+            segment.t0_ms += offset_ms;
+            segment.t1_ms += offset_ms;
+        }
+        done[i] = 1;
+    };
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < n_workers; ++w) {
+        workers.emplace_back([&] {
+            whisper_state* state = whisper_init_state(model.get());
+            if (!state) {
+                LOG_W("Failed to create whisper state for parallel transcription");
+                return;
+            }
+            for (size_t i = nextChunk++; i < chunks.size(); i = nextChunk++) {
+                transcribeChunk(state, i);
+            }
+            whisper_free_state(state);
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    std::vector<TranscriptSegment> stitched;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (!done[i]) {
+            // No state could take this chunk, fall back to the default state
+            transcribeChunk(nullptr, i);
+        }
+        for (auto& segment : results[i]) {
+            LOG_V("[" << segment.t0_ms << " ms --> " << segment.t1_ms << " ms] " << segment.text);
+            stitched.push_back(std::move(segment));
+        }
+    }
+
+    // One real-time factor for the whole recording: per chunk, the states
+    // competing for the CPU would each look slow and step live quality down
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    RecordRealTimeFactor(pcmf32.size(), ms);
+    LOG_I("Parallel transcription of " << (pcmf32.size() * 1000 / kSampleRate) << " ms of audio took " << ms << " ms");
+
+    if (stitched.empty()) {
+        LOG_W("No transcription result produced");
+        return false;
+    }
+
+    std::string full_text = JoinSegments(stitched);
+    std::cout << "Transcribed: " << full_text << std::endl;
+    _responseCallback.OnResponseComplete(true, full_text.c_str());
+    return true;
+}
+
+// Fast model pass over the tail of the utterance in progress
+void WhisperTranscriber::TranscribePartial() {
+    const size_t window = std::min(_utterance.size(), kStreamingWindowSamples);
+    std::vector<float> pcmf32(_utterance.end() - window, _utterance.end());
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<TranscriptSegment> segments;
+    bool produced = RunWhisper(_fastWhisperContext, nullptr, BuildParams(true), pcmf32, segments);
+    std::string text = JoinSegments(segments);
+    double ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+
+    {
+        std::lock_guard<std::mutex> lock(_statsMutex);
+        _stats.partials++;
+        _stats.partial_latency_ms = ms;
+        _stats.partial_latency_avg_ms += (ms - _stats.partial_latency_avg_ms) / _stats.partials;
+    }
+
+    if (produced) {
+        LOG_V("Partial (" << ms << " ms): " << text);
+        _partialCallback.OnResponseComplete(true, text.c_str());
+    }
+}
+
+// Hand the current utterance to the accurate model
+void WhisperTranscriber::QueueFinalTranscription() {
+    PendingUtterance pending;
+    pending.pcmf32.swap(_utterance);
+    pending.endpointed = std::chrono::steady_clock::now();
+
+    _inVoiceSegment = false;
+    _samplesSinceVoiceStart = 0;
+    _silentSamplesCount = 0;
+    _samplesSincePartial = 0;
+
+    // The utterance was counted against the budget when it came in, moving it
+    // to the queue changes nothing. Shedding under load happens at ingest.
+    {
+        std::lock_guard<std::mutex> lock(_finalMutex);
+        _finalQueuedSamples += pending.pcmf32.size();
+        _finalQueue.push(std::move(pending));
+    }
+    _utteranceSamples = 0;
+    _finalCondition.notify_one();
+}
+
+bool WhisperTranscriber::ProcessAudioBuffer(uint8_t* playoutBuffer, size_t kPlayoutBufferSize) {
+    if (!Model()) {
         LOG_E("Whisper context is not initialized");
-        return;
+        return false;
     }
 
     // Handle end-of-stream marker
@@ -384,92 +653,415 @@ void WhisperTranscriber::ProcessAudioBuffer(uint8_t* playoutBuffer, size_t kPlay
             _processingThread.join();
         }
 
-        // Process any remaining audio
+        // Let the accurate model finish utterances endpointed so far
+        StopFinalThread();
+
+        // Process the utterance in progress plus any remaining audio
         std::vector<float> audioBuffer;
+        audioBuffer.swap(_utterance);
+        _utteranceSamples = 0;
         size_t samples_available = _audioBuffer->availableToRead();
         if (samples_available > 0) {
-            audioBuffer.resize(samples_available);
-            if (_audioBuffer->read(audioBuffer.data(), samples_available)) {
-                LOG_I("Processing final " << samples_available << " samples");
-                TranscribeAudioNonBlocking(audioBuffer);
+            const size_t offset = audioBuffer.size();
+            audioBuffer.resize(offset + samples_available);
+            if (!_audioBuffer->read(audioBuffer.data() + offset, samples_available)) {
+                audioBuffer.resize(offset);
             }
         }
+        _inVoiceSegment = false;
+        _samplesSinceVoiceStart = 0;
+        _silentSamplesCount = 0;
+        _samplesSincePartial = 0;
+
+        if (audioBuffer.size() >= kParallelMinSamples) {
+            TranscribeParallel(audioBuffer);
+        } else if (!audioBuffer.empty()) {
+            LOG_I("Processing final " << audioBuffer.size() << " samples");
+            TranscribeAudioNonBlocking(audioBuffer);
+        }
         
         _responseCallback.OnResponseComplete(true, "End of stream processed");
-        return;
+        return true;
     }
 
-    // Convert bytes to samples and immediately to float
-    size_t numSamples = kPlayoutBufferSize / sizeof(int16_t);
-    if (numSamples == 0) {
-        return;  // Skip empty buffers silently
-    }
+    // Legacy entry point: 16 kHz mono int16 in a byte buffer
+    return IngestAudio<Int16Decoder>(reinterpret_cast<const int16_t*>(playoutBuffer),
+                                     kPlayoutBufferSize / sizeof(int16_t), kSampleRate, kChannels);
+}
 
-    // Convert int16 samples to float
-    std::vector<float> pcmf32(numSamples);
-    const int16_t* samples = reinterpret_cast<const int16_t*>(playoutBuffer);
-    for (size_t i = 0; i < numSamples; i++) {
-        pcmf32[i] = static_cast<float>(samples[i]) / 32768.0f;
+bool WhisperTranscriber::ProcessAudioInt16(const int16_t* samples, size_t frames, int sampleRate, int channels) {
+    return IngestAudio<Int16Decoder>(samples, frames, sampleRate, channels);
+}
+
+bool WhisperTranscriber::ProcessAudioFloat(const float* samples, size_t frames, int sampleRate, int channels) {
+    return IngestAudio<Float32Decoder>(samples, frames, sampleRate, channels);
+}
+
+bool WhisperTranscriber::ProcessAudioMuLaw(const uint8_t* samples, size_t frames, int sampleRate, int channels) {
+    return IngestAudio<MuLawDecoder>(samples, frames, sampleRate, channels);
+}
+
+// Decode, downmix and resample straight into the ring buffer in one pass
+template <typename Decoder, typename In>
+bool WhisperTranscriber::IngestAudio(const In* data, size_t frames, int sampleRate, int channels) {
+    if (!Model()) {
+        LOG_E("Whisper context is not initialized");
+        return false;
+    }
+    if (sampleRate <= 0 || channels <= 0) {
+        LOG_E("Invalid audio format: " << sampleRate << " Hz, " << channels << " channels");
+        return false;
+    }
+    if (frames == 0 || data == nullptr) {
+        return true;  // Skip empty buffers silently
     }
 
-    // Write to ring buffer
-    if (!_audioBuffer->write(pcmf32.data(), pcmf32.size())) {
-        LOG_E("Failed to write to audio buffer");
+    std::lock_guard<std::mutex> lock(_ingestMutex);
+    const size_t numSamples = _ingest.begin(sampleRate, channels, frames);
+
+    // The write fails only when the session is over budget
+    const size_t budget = _audioBudgetSamples;
+    bool written = (budget == 0 || HeldSamples() + numSamples <= budget) &&
+                   _audioBuffer->writeWith(numSamples, [this, data](float* dst, size_t count) {
+        _ingest.emit<Decoder>(data, dst, count);
+    });
+    if (!written) {
+        std::vector<float> pcmf32(numSamples);
+        _ingest.emit<Decoder>(data, pcmf32.data(), numSamples);
+        _ingest.finish<Decoder>(data);
+        return handleOverflow(pcmf32.data(), pcmf32.size());
     }
-    LOG_V("Wrote to audio buffer"); 
+
+    _ingest.finish<Decoder>(data);
+    return true;
 }
 
 bool WhisperTranscriber::RunProcessingThread() {
+    // More sensitive VAD parameters for microphone input
+    const float vad_thold = 0.0003f;
+    const float freq_thold = 10.0f;
+
     while (_running) {
-        std::vector<float> audioBuffer;
-        bool shouldProcess = false;
-        
-        // Check available samples
-        size_t samples_available = _audioBuffer->availableToRead();
-        
-        // Process when we have enough data (at least 10 seconds worth)
-        if (samples_available >= WHISPER_SAMPLE_RATE * 10) {
-            audioBuffer.resize(samples_available);
-            if (_audioBuffer->read(audioBuffer.data(), samples_available)) {
-                shouldProcess = true;
-                LOG_V("Got " << samples_available << " samples to process");
-            }
-        } else {
+        if (_audioBuffer->availableToRead() < kVadStepSamples) {
             // Keep accumulating
             std::this_thread::sleep_for(std::chrono::milliseconds(10));
             continue;
         }
-        
-        if (shouldProcess) {
-            // More sensitive VAD parameters for microphone input
-            const float vad_thold = 0.0003f;    // Lowered from 0.01f
-            const float freq_thold = 10.0f;     // Lowered from 20.0f
-            const int last_ms = 1000;           // Increased window
-
-            bool voicePresent = vad_simple(audioBuffer, WHISPER_SAMPLE_RATE, last_ms, vad_thold, freq_thold, true);
-            LOG_V("VAD check: voice present = " << (voicePresent ? "true" : "false") 
-                  << ", buffer size = " << audioBuffer.size() 
-                  << ", threshold = " << vad_thold);
-
-            if (voicePresent) {
-                LOG_V("Voice detected, starting transcription with " << audioBuffer.size() << " samples");
-                TranscribeAudioNonBlocking(audioBuffer);
-            } else {
-                LOG_V("No voice detected in buffer");
+
+        // Before speech starts, only keep a short preroll in front of the step
+        if (!_inVoiceSegment && _utterance.size() > kPrerollBufferSize) {
+            _utterance.erase(_utterance.begin(), _utterance.end() - kPrerollBufferSize);
+        }
+
+        // Count the step as part of the utterance before it leaves the ring
+        // buffer, so ingest never sees it in neither
+        const size_t offset = _utterance.size();
+        _utteranceSamples = offset + kVadStepSamples;
+        _utterance.resize(offset + kVadStepSamples);
+        if (!_audioBuffer->read(_utterance.data() + offset, kVadStepSamples)) {
+            _utterance.resize(offset);
+            _utteranceSamples = offset;
+            continue;
+        }
+
+        // One VAD decision per step drives both tiers
+        bool voicePresent = vad_simple(_utterance, kSampleRate, kVadWindowMs, vad_thold, freq_thold, false);
+        if (voicePresent) {
+            if (!_inVoiceSegment) {
+                LOG_V("Voice start detected");
+            }
+            _inVoiceSegment = true;
+            _silentSamplesCount = 0;
+        } else if (_inVoiceSegment) {
+            _silentSamplesCount += kVadStepSamples;
+        }
+
+        if (!_inVoiceSegment) {
+            continue;
+        }
+
+        _samplesSinceVoiceStart += kVadStepSamples;
+        _samplesSincePartial += kVadStepSamples;
+
+        // Endpoint on trailing silence, or force one when the utterance gets too long
+        if (_silentSamplesCount >= kEndpointSilenceSamples || _utterance.size() >= kTargetSamples) {
+            LOG_V("Endpoint after " << _samplesSinceVoiceStart << " samples, queueing final transcription");
+            QueueFinalTranscription();
+            continue;
+        }
+
+        // Partials are the first thing to go at the lowest quality level
+        if (_fastWhisperContext && _samplesSincePartial >= kPartialStepSamples &&
+            !kQualityLevels[_qualityLevel].fast_model) {
+            _samplesSincePartial = 0;
+            TranscribePartial();
+        }
+    }
+    return true;
+}
+
+// Runs the accurate model once per endpointed utterance, in arrival order
+bool WhisperTranscriber::RunFinalThread() {
+    while (true) {
+        PendingUtterance pending;
+        {
+            std::unique_lock<std::mutex> lock(_finalMutex);
+            _finalCondition.wait(lock, [this] { return !_finalQueue.empty() || !_finalRunning; });
+            if (_finalQueue.empty()) {
+                return false;  // Stopped and drained
+            }
+            pending = std::move(_finalQueue.front());
+            _finalQueue.pop();
+        }
+
+        TranscribeAudioNonBlocking(pending.pcmf32);
+        {
+            std::lock_guard<std::mutex> lock(_finalMutex);
+            _finalQueuedSamples -= pending.pcmf32.size();
+        }
+
+        double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - pending.endpointed).count();
+        LOG_V("Final transcript " << ms << " ms after endpoint");
+
+        std::lock_guard<std::mutex> lock(_statsMutex);
+        _stats.finals++;
+        _stats.final_latency_ms = ms;
+        _stats.final_latency_avg_ms += (ms - _stats.final_latency_avg_ms) / _stats.finals;
+    }
+}
+
+// Finish whatever utterances are queued, then stop the final thread
+void WhisperTranscriber::StopFinalThread() {
+    {
+        std::lock_guard<std::mutex> lock(_finalMutex);
+        _finalRunning = false;
+    }
+    _finalCondition.notify_all();
+    if (_finalThread.joinable()) {
+        _finalThread.join();
+    }
+}
+
+// Audio accepted but not yet transcribed
+size_t WhisperTranscriber::HeldSamples() const {
+    return PendingSamples() + _utteranceSamples;
+}
+
+size_t WhisperTranscriber::PendingSamples() const {
+    size_t pending = _audioBuffer->availableToRead();
+    std::lock_guard<std::mutex> lock(_finalMutex);
+    return pending + _finalQueuedSamples;
+}
+
+WhillatsTranscriberStats WhisperTranscriber::GetStats() const {
+    const size_t pending = PendingSamples();
+
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    WhillatsTranscriberStats stats = _stats;
+    stats.lag_ms = pending * 1000.0 / kSampleRate;
+    stats.quality = static_cast<WhillatsTranscriptionQuality>(_qualityLevel.load());
+    stats.real_time_factor = _rtfAverage;
+    return stats;
+}
+
+WhillatsTranscriptionQuality WhisperTranscriber::GetQuality() const {
+    return static_cast<WhillatsTranscriptionQuality>(_qualityLevel.load());
+}
+
+void WhisperTranscriber::SetAdaptiveQuality(bool enabled, WhillatsTranscriptionQuality level) {
+    _adaptiveQuality = enabled;
+    if (!enabled) {
+        _qualityLevel = static_cast<int>(level);
+    }
+}
+
+// Feed one final transcription's cost into the quality controller
+void WhisperTranscriber::RecordRealTimeFactor(size_t samples, double processingMs) {
+    if (samples == 0) {
+        return;
+    }
+    const double rtf = processingMs / (samples * 1000.0 / kSampleRate);
+    const double lagMs = PendingSamples() * 1000.0 / kSampleRate;
+    const int maxLevel = static_cast<int>(WhillatsTranscriptionQuality::Minimal);
+
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    _rtfAverage = _rtfAverage == 0 ? rtf : 0.7 * _rtfAverage + 0.3 * rtf;
+    if (!_adaptiveQuality) {
+        return;
+    }
+
+    int level = _qualityLevel;
+    if (_rtfAverage > kRtfStepDown || lagMs > kLagStepDownMs) {
+        _underloadedSegments = 0;
+        if (++_overloadedSegments >= kStepDownAfter && level < maxLevel) {
+            level++;
+        }
+    } else if (_rtfAverage < kRtfStepUp && lagMs < kLagStepDownMs / 2) {
+        _overloadedSegments = 0;
+        if (++_underloadedSegments >= kStepUpAfter && level > 0) {
+            level--;
+        }
+    } else {
+        _overloadedSegments = 0;
+        _underloadedSegments = 0;
+    }
+
+    if (level != _qualityLevel) {
+        LOG_I("Transcription quality " << _qualityLevel << " -> " << level
+              << " (rtf " << _rtfAverage << ", lag " << lagMs << " ms)");
+        _qualityLevel = level;
+        _overloadedSegments = 0;
+        _underloadedSegments = 0;
+        _stats.quality_changes++;
+    }
+}
+
+void WhisperTranscriber::SetAudioBudget(size_t maxSamples, WhillatsOverflowPolicy policy) {
+    _audioBudgetSamples = maxSamples;
+    _overflowPolicy = policy;
+    _audioBuffer->setMaxSize(maxSamples);
+}
+
+// Called when the ring buffer refused a write because the session is at its
+// audio budget. Returns false if the audio was not accepted.
+bool WhisperTranscriber::handleOverflow(const float* data, size_t size) {
+    const size_t budget = _audioBudgetSamples;
+    if (budget == 0) {
+        return _audioBuffer->write(data, size);  // Unbounded, nothing to shed
+    }
+    const WhillatsOverflowPolicy policy = _overflowPolicy;
+    size_t dropped = 0;
+    size_t refused = 0;
+    bool accepted = false;
+
+    if (policy == WhillatsOverflowPolicy::RefuseInput) {
+        // Back-pressure: the caller keeps the new audio, nothing held is lost
+        refused = size;
+    } else {
+        // A single write larger than the whole budget keeps only its tail
+        if (size > budget) {
+            dropped += size - budget;
+            data += size - budget;
+            size = budget;
+        }
+
+        // Unprocessed audio goes first, all of it or just enough
+        if (policy == WhillatsOverflowPolicy::SkipToLatest) {
+            dropped += _audioBuffer->discard(_audioBuffer->availableToRead());
+        } else {
+            const size_t held = HeldSamples();
+            if (held + size > budget) {
+                dropped += _audioBuffer->discard(held + size - budget);
             }
         }
+
+        // Then whole utterances still waiting for whisper, oldest first. The
+        // one in progress and the one being transcribed stay.
+        if (HeldSamples() + size > budget) {
+            std::lock_guard<std::mutex> lock(_finalMutex);
+            const size_t utterance = _utteranceSamples;
+            while (!_finalQueue.empty() &&
+                   _audioBuffer->availableToRead() + utterance + _finalQueuedSamples + size > budget) {
+                dropped += _finalQueue.front().pcmf32.size();
+                _finalQueuedSamples -= _finalQueue.front().pcmf32.size();
+                _finalQueue.pop();
+            }
+        }
+        accepted = HeldSamples() + size <= budget && _audioBuffer->write(data, size);
+        if (!accepted) {
+            dropped += size;
+        }
+    }
+
+    uint64_t events;
+    {
+        std::lock_guard<std::mutex> lock(_statsMutex);
+        _stats.dropped_samples += dropped;
+        _stats.refused_samples += refused;
+        events = ++_stats.overflow_events;
+    }
+
+    // Log the first overflow and then every 100th to avoid flooding under load
+    if (events % 100 == 1) {
+        LOG_W("Audio budget of " << budget << " samples exceeded (" << events << " overflows), "
+              << "dropped " << dropped << ", refused " << refused);
+    }
+    return accepted;
+}
+
+std::shared_ptr<whisper_context> WhisperTranscriber::Model() const {
+    return std::atomic_load(&_whisperContext);
+}
+
+bool WhisperTranscriber::SwapModel(const std::string& modelPath) {
+    std::lock_guard<std::mutex> lock(_swapMutex);
+    if (_swapping || modelPath.empty()) {
+        return false;
     }
+    if (_swapThread.joinable()) {
+        _swapThread.join();
+    }
+    _swapping = true;
+    _swapThread = std::thread([this, modelPath] { LoadSwapModel(modelPath); });
     return true;
 }
 
+// Runs on _swapThread while transcription goes on with the old model
+void WhisperTranscriber::LoadSwapModel(const std::string& modelPath) {
+    auto start = std::chrono::steady_clock::now();
+    PeakMemorySampler memory;
+    std::string oldPath;
+    {
+        std::lock_guard<std::mutex> lock(_swapMutex);
+        oldPath = _model_path;
+    }
+
+    whisper_context* context = whisper_init_from_file_with_params(modelPath.c_str(), whisper_context_default_params());
+    if (!context) {
+        context = TryAlternativeInitMethods(modelPath);
+    }
+    if (!context) {
+        LOG_E("Failed to load Whisper model " << modelPath << ", keeping " << oldPath);
+        std::lock_guard<std::mutex> lock(_swapMutex);
+        _swapping = false;
+        return;
+    }
+
+    // Frees the old model here unless a transcription still holds it
+    std::atomic_store(&_whisperContext, std::shared_ptr<whisper_context>(context, whisper_free));
+    const uint64_t peakBytes = memory.stop();
+    const double swapMs = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    {
+        std::lock_guard<std::mutex> lock(_statsMutex);
+        _stats.model_swaps++;
+        _stats.model_swap_ms = swapMs;
+        _stats.model_swap_peak_bytes = peakBytes;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_swapMutex);
+        _model_path = modelPath;
+        _swapping = false;
+    }
+    LOG_I("Whisper model swapped to " << modelPath << " in " << swapMs << " ms, peak resident "
+          << peakBytes / (1024 * 1024) << " MiB");
+}
+
 bool WhisperTranscriber::start() {
 
-    if(_whisperContext == nullptr) {
+    if (!Model()) {
         LOG_E("Whisper context is not initialized");
         return false;
     }
 
     if (!_running) {
+        _finalRunning = true;
+        _finalThread = std::thread([this] {
+            while (RunFinalThread()) {
+            }
+        });
+
         _running = true;
         _processingThread = std::thread([this] {
              while (_running && RunProcessingThread()) {
@@ -489,4 +1081,5 @@ void WhisperTranscriber::stop() {
             _processingThread.join();
         }
     }
+    StopFinalThread();
 }
@@ -32,13 +32,29 @@
 #include "whillats.h"
 #include "silence_finder.h"
 #include "whisper_helpers.h"
+#include "audio_ingest.h"
 
 struct whisper_context;
+struct whisper_state;
+struct whisper_full_params;
 
 class WhisperTranscriber {
  private:
   std::string _model_path;
-  whisper_context* _whisperContext;
+  // Swapped by SwapModel(), always read through Model(). Each transcription
+  // holds its own reference, the old model goes with the last of them.
+  std::shared_ptr<whisper_context> _whisperContext;
+  std::shared_ptr<whisper_context> Model() const;
+
+  std::thread _swapThread;
+  bool _swapping = false;
+  std::mutex _swapMutex;                     // Guards _model_path, _swapping and _swapThread
+  void LoadSwapModel(const std::string& modelPath);
+
+  // Optional small model used for partial hypotheses while an utterance is
+  // still being spoken. The final transcript always comes from _whisperContext.
+  std::string _fast_model_path;
+  whisper_context* _fastWhisperContext;
 
   std::thread _processingThread;
   std::atomic<bool> _running;
@@ -53,16 +69,71 @@ class WhisperTranscriber {
 
   static constexpr size_t kTargetSamples = kSampleRate * 12;  // 12 seconds (in samples)
   static constexpr size_t kSilenceSamples = 16000; // 1 second of silence at 16kHz
+  static constexpr size_t kDefaultAudioBudgetSamples = kSampleRate * 60; // 60 seconds per session
+
+  // Streaming / endpointing constants
+  static constexpr size_t kVadStepSamples = kSampleRate / 10;              // VAD every 100ms of audio
+  static constexpr int kVadWindowMs = 100;                                  // VAD looks at the last 100ms
+  static constexpr size_t kEndpointSilenceSamples = kSampleRate * 6 / 10;  // 600ms of silence ends an utterance
+  static constexpr size_t kPartialStepSamples = kSampleRate / 2;           // partial hypothesis every 500ms
+  static constexpr size_t kStreamingWindowSamples = kSampleRate * 5;       // fast model sees the last 5 seconds
+
+  // Long end-of-stream buffers are split at silences and transcribed in parallel
+  static constexpr size_t kParallelMinSamples = kSampleRate * 30;          // below this stay serial
+  static constexpr size_t kChunkTargetSamples = kSampleRate * 20;
+  static constexpr size_t kChunkMinSamples = kSampleRate * 5;
+  static constexpr size_t kChunkMaxSamples = kSampleRate * 28;             // stay inside whisper's 30s window
+  static constexpr int kThreadsPerState = 4;
+  static constexpr int kMaxParallelStates = 8;
+
+  // Load adaptation: step quality down when the smoothed real-time factor or
+  // the backlog is high for a few segments, back up when it stays low for longer
+  static constexpr double kRtfStepDown = 0.8;
+  static constexpr double kRtfStepUp = 0.3;
+  static constexpr double kLagStepDownMs = 5000;
+  static constexpr int kStepDownAfter = 2;
+  static constexpr int kStepUpAfter = 5;
+
+  struct QualityLevel {
+    bool beam;
+    int audio_ctx;
+    int max_tokens;
+    bool fast_model;
+  };
+  static const QualityLevel kQualityLevels[];
+
+  std::atomic<int> _qualityLevel;
+  std::atomic<bool> _adaptiveQuality;
+  double _rtfAverage = 0;
+  int _overloadedSegments = 0;
+  int _underloadedSegments = 0;
+  whisper_state* _fastFinalState = nullptr;  // Finals on the fast model must not share the partials' state
+  void RecordRealTimeFactor(size_t samples, double processingMs);
+  size_t PendingSamples() const;
 
   // Replace vector of chunks with ring buffer
   std::unique_ptr<AudioRingBuffer<float>> _audioBuffer;
   std::mutex _audioMutex;
 
+  // Converts caller audio to 16 kHz mono float on its way into _audioBuffer
+  AudioIngestConverter _ingest;
+  std::mutex _ingestMutex;
+  template <typename Decoder, typename In>
+  bool IngestAudio(const In* data, size_t frames, int sampleRate, int channels);
+
   // State to keep track if we're in a voice segment
   bool _inVoiceSegment = false;
   size_t _samplesSinceVoiceStart = 0;
   size_t _silentSamplesCount = 0; // New: Count of silent samples
-  void handleOverflow();
+
+  // Per-session audio budget, covers the ring buffer, the utterance in
+  // progress and the final queue. Enforced at ingest, audio only moves
+  // between the three after that.
+  std::atomic<size_t> _audioBudgetSamples;
+  std::atomic<WhillatsOverflowPolicy> _overflowPolicy;
+  std::atomic<size_t> _utteranceSamples;     // _utterance.size(), for ingest threads
+  size_t HeldSamples() const;
+  bool handleOverflow(const float* data, size_t size);
 
   std::vector<int16_t> _processingBuffer;
   
@@ -76,6 +147,26 @@ class WhisperTranscriber {
   std::chrono::steady_clock::time_point _lastTranscriptionEnd;
 
   WhillatsSetResponseCallback _responseCallback;
+  WhillatsSetResponseCallback _partialCallback;
+
+  // Audio of the utterance in progress, shared by both tiers
+  std::vector<float> _utterance;
+  size_t _samplesSincePartial = 0;
+
+  // Endpointed utterances waiting for the accurate model
+  struct PendingUtterance {
+    std::vector<float> pcmf32;
+    std::chrono::steady_clock::time_point endpointed;
+  };
+  std::queue<PendingUtterance> _finalQueue;
+  size_t _finalQueuedSamples = 0;  // Includes the utterance being transcribed
+  mutable std::mutex _finalMutex;
+  std::condition_variable _finalCondition;
+  std::thread _finalThread;
+  bool _finalRunning = false;
+
+  WhillatsTranscriberStats _stats;
+  mutable std::mutex _statsMutex;
 
   static constexpr size_t kPrerollBufferSize = 1600;  // 100ms at 16kHz (in samples)
   std::vector<float> _prerollBuffer;              // Changed from uint8_t to float
@@ -94,18 +185,44 @@ class WhisperTranscriber {
   bool InitializeWhisperModel(const std::string& modelPath);
   whisper_context* TryAlternativeInitMethods(const std::string& modelPath);
   bool ValidateWhisperModel(const std::string& modelPath);
+  struct TranscriptSegment {
+    int64_t t0_ms;
+    int64_t t1_ms;
+    std::string text;
+  };
+
+  whisper_full_params BuildParams(bool partial) const;
+  bool RunWhisper(whisper_context* ctx, whisper_state* state, const whisper_full_params& wparams,
+                  const std::vector<float>& pcmf32, std::vector<TranscriptSegment>& segments);
+  static std::string JoinSegments(const std::vector<TranscriptSegment>& segments);
   bool TranscribeAudioNonBlocking(const std::vector<float>& pcmf32);
+  std::vector<std::pair<size_t, size_t>> SplitAtSilences(std::vector<float>& pcmf32) const;
+  bool TranscribeParallel(std::vector<float>& pcmf32);
+  void TranscribePartial();
+  void QueueFinalTranscription();
   bool RunProcessingThread();
+  bool RunFinalThread();
+  void StopFinalThread();
 
  public:
 
   WhisperTranscriber(
       const char* model_path,
-      WhillatsSetResponseCallback callback);
+      WhillatsSetResponseCallback callback,
+      const char* fast_model_path = nullptr,
+      WhillatsSetResponseCallback partial_callback = WhillatsSetResponseCallback(nullptr, nullptr));
   
   ~WhisperTranscriber();
 
-  void ProcessAudioBuffer(uint8_t* playoutBuffer, size_t kPlayoutBufferSize);
+  bool ProcessAudioBuffer(uint8_t* playoutBuffer, size_t kPlayoutBufferSize);
+  bool ProcessAudioInt16(const int16_t* samples, size_t frames, int sampleRate, int channels);
+  bool ProcessAudioFloat(const float* samples, size_t frames, int sampleRate, int channels);
+  bool ProcessAudioMuLaw(const uint8_t* samples, size_t frames, int sampleRate, int channels);
+  WhillatsTranscriberStats GetStats() const;
+  void SetAudioBudget(size_t maxSamples, WhillatsOverflowPolicy policy);
+  WhillatsTranscriptionQuality GetQuality() const;
+  void SetAdaptiveQuality(bool enabled, WhillatsTranscriptionQuality level);
+  bool SwapModel(const std::string& modelPath);
 
   bool start();
   void stop();
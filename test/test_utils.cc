@@ -31,8 +31,11 @@ Options parseOptions(int argc, char *argv[])
                      "  --tts, --no-tts                    Enable/disable tts (default: disabled)\n"
                      "  --whisper, --no-whisper            Enable/disable whisper (default: disabled)\n"
                      "  --llama, --no-llama                Enable/disable llama (default: disabled)\n"
+                     "  --bench                            Run the microbenchmarks\n"
                      "  --whisper_model=<path>             Path to whisper model\n"
+                     "  --whisper_fast_model=<path>        Path to fast whisper model for partials\n"
                      "  --llama_model=<path>               Path to llama model\n"
+                     "  --llama_draft_model=<path>         Path to draft model for speculative decoding\n"
                      "  --help                             Show this help message\n"
                      "\nExamples:\n"
                      "  test_whillats --whisper --whisper_model=model.bin\n"
@@ -71,6 +74,10 @@ Options parseOptions(int argc, char *argv[])
     {
       opts.llama = false;
     }
+    else if (arg == "--bench")
+    {
+      opts.bench = true;
+    }
     else if (arg.find("--whisper_model=") == 0)
     {
       opts.whisper_model = arg.substr(16); // Length of "-whisper_model="
@@ -78,6 +85,16 @@ Options parseOptions(int argc, char *argv[])
       if (!opts.whisper)
         opts.whisper = true;
     }
+    else if (arg.find("--whisper_fast_model=") == 0)
+    {
+      opts.whisper_fast_model = arg.substr(21); // Length of "--whisper_fast_model="
+      LOG_I("Whisper fast model path: " << opts.whisper_fast_model);
+    }
+    else if (arg.find("--llama_draft_model=") == 0)
+    {
+      opts.llama_draft_model = arg.substr(20); // Length of "--llama_draft_model="
+      LOG_I("Llama draft model path: " << opts.llama_draft_model);
+    }
     else if (arg.find("--llama_model=") == 0)
     {
       opts.llama_model = arg.substr(14); // Length of "-llama_model="
@@ -111,7 +128,9 @@ std::string getUsage(const Options opts)
   usage << "\nWhisper: " << (opts.whisper ? "enabled" : "disabled") << "\n";
   usage << "Llama: " << (opts.llama ? "enabled" : "disabled") << "\n";
   usage << "Whisper Model: " << opts.whisper_model << "\n";
+  usage << "Whisper Fast Model: " << opts.whisper_fast_model << "\n";
   usage << "Llama Model: " << opts.llama_model << "\n";
+  usage << "Llama Draft Model: " << opts.llama_draft_model << "\n";
 
   return usage.str();
 }
@@ -19,9 +19,12 @@ struct Options {
     bool tts = false;
     bool whisper = false;
     bool llama = false;
+    bool bench = false;
     std::string help_string;
     std::string whisper_model;
+    std::string whisper_fast_model;
     std::string llama_model;
+    std::string llama_draft_model;
 };
 
 // Function to parse command line string to above options
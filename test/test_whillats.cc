@@ -12,10 +12,13 @@
 
 #include <iostream>
 #include <vector>
+#include <cmath>
 #include "whillats.h"
 
 #include "test_utils.h"
 #include "whisper_helpers.h"
+#include "llama_stop_engine.h"
+#include "audio_ingest.h"
 
 // Set log level
 void setLogLevel(LogLevel level)
@@ -44,12 +47,107 @@ void whisperResponseCallback(bool success, const char* response, void* user_data
     whisper_done = true; 
 }
 
+void whisperPartialCallback(bool success, const char* response, void* user_data) {
+    std::cout << "Whisper partial via callback: " << response << std::endl;
+}
+
 void llamaResponseCallback(bool success, const char* response, void* user_data) {
     // Handle response here
     std::cout << "Llama response via callback: " << response << std::endl;
     llama_done = true;   
 }
 
+void llamaTokenCallback(const WhillatsLlamaToken* token, void* user_data) {
+    LOG_V("Llama token " << token->index << " '" << token->text << "' at " << token->time_ms
+          << " ms, +" << token->interval_ms << " ms");
+}
+
+void llamaDoneCallback(WhillatsLlamaStopReason reason, const char* response, void* user_data) {
+    std::cout << "Llama turn done, stop reason " << static_cast<int>(reason) << std::endl;
+    *static_cast<bool*>(user_data) = true;
+}
+
+void llamaConcurrentCallback(bool success, const char* response, void* user_data) {
+    std::cout << "Llama concurrent response via callback: " << response << std::endl;
+    *static_cast<bool*>(user_data) = true;
+}
+
+// One second of interleaved test input at rate, sample i of channel c
+template <typename In>
+std::vector<In> makeIngestInput(int rate, int channels)
+{
+  std::vector<In> input(rate * channels);
+  for (size_t i = 0; i < input.size(); ++i)
+  {
+    const double phase = 2.0 * M_PI * 440.0 * (i / channels) / rate + (i % channels);
+    input[i] = static_cast<In>(std::sin(phase) * 0.5 * (sizeof(In) == 2 ? 32767 : 1));
+  }
+  return input;
+}
+
+template <>
+std::vector<uint8_t> makeIngestInput<uint8_t>(int rate, int channels)
+{
+  std::vector<uint8_t> input(rate * channels);
+  for (size_t i = 0; i < input.size(); ++i)
+  {
+    input[i] = static_cast<uint8_t>(i * 37);
+  }
+  return input;
+}
+
+// Feeds the input through the converter in chunks of `chunk` frames, each
+// copied to a buffer of exactly its size so reads past it show under ASan.
+// One second in should give one second at 16 kHz, every sample in range.
+template <typename Decoder, typename In>
+bool checkIngest(const std::vector<In> &input, int rate, int channels, size_t chunk)
+{
+  AudioIngestConverter converter;
+  std::vector<float> out;
+  const size_t frames = input.size() / channels;
+  for (size_t pos = 0; pos < frames; pos += chunk)
+  {
+    const size_t n_frames = std::min(chunk, frames - pos);
+    std::vector<In> piece(input.begin() + pos * channels, input.begin() + (pos + n_frames) * channels);
+    const size_t n = converter.begin(rate, channels, n_frames);
+    const size_t offset = out.size();
+    out.resize(offset + n);
+    converter.emit<Decoder>(piece.data(), out.data() + offset, n);
+    converter.finish<Decoder>(piece.data());
+  }
+
+  bool ok = std::abs(static_cast<long>(out.size()) - AudioIngestConverter::kOutRate) <= 2;
+  for (float sample : out)
+  {
+    ok = ok && std::isfinite(sample) && std::fabs(sample) <= 1.0f;
+  }
+  if (!ok)
+  {
+    LOG_E("Audio ingest failed for " << rate << " Hz, " << channels << " channels, " << chunk
+          << " frame chunks: " << out.size() << " samples out");
+  }
+  return ok;
+}
+
+bool checkAudioIngest()
+{
+  bool ok = true;
+  for (int rate : {8000, 16000, 44100, 48000})
+  {
+    for (int channels : {1, 2})
+    {
+      for (size_t chunk : {1, 7, 13, 160, 161})
+      {
+        ok = checkIngest<Int16Decoder>(makeIngestInput<int16_t>(rate, channels), rate, channels, chunk) && ok;
+        ok = checkIngest<Float32Decoder>(makeIngestInput<float>(rate, channels), rate, channels, chunk) && ok;
+        ok = checkIngest<MuLawDecoder>(makeIngestInput<uint8_t>(rate, channels), rate, channels, chunk) && ok;
+      }
+    }
+  }
+  LOG_I("Audio ingest conversion " << (ok ? "passed" : "FAILED"));
+  return ok;
+}
+
 int main(int argc, char *argv[])
 {
   Options opts = parseOptions(argc, argv);
@@ -65,6 +163,38 @@ int main(int argc, char *argv[])
 
   setLogLevel(LogLevel::VERBOSE);
 
+  if (opts.bench) {
+    if (!checkAudioIngest()) {
+      return 1;
+    }
+
+    // Stop engine cost per token should not grow with the response length
+    const char* pieces[] = {" the", " weather", " is", " fine", " today", ",", " yeah", ".", " okay", " so"};
+    const size_t n_pieces = sizeof(pieces) / sizeof(pieces[0]);
+    for (size_t turn_tokens : {64, 256, 1024, 4096}) {
+      LlamaStopEngine stop_engine;
+      stop_engine.setStopStrings({"User:", "<|im_start|>"});
+      const size_t turns = 1000000 / turn_tokens;
+      size_t stops = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (size_t t = 0; t < turns; ++t) {
+        stop_engine.reset();
+        for (size_t i = 0; i < turn_tokens; ++i) {
+          const char* piece = pieces[(i * 7 + t) % n_pieces];
+          if (stop_engine.feed(false, piece, strlen(piece)) != LlamaStopReason::None) {
+            stops++;
+          }
+          if (piece[0] == '.') {
+            stop_engine.resetPhrase();
+          }
+        }
+      }
+      double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      LOG_I("Stop engine: " << ns / (turns * turn_tokens) << " ns/token over " << turn_tokens
+            << " token turns, " << stops << " stops");
+    }
+  }
+
   if (opts.tts) {
     WhillatsSetAudioCallback callback(ttsAudioCallback, nullptr);
     WhillatsTTS tts(callback); 
@@ -102,7 +232,10 @@ int main(int argc, char *argv[])
   if (opts.whisper) {
     // Test WhisperTranscription
     WhillatsSetResponseCallback callback(whisperResponseCallback, nullptr);
-    WhillatsTranscriber whisper(opts.whisper_model.c_str(), callback);
+    WhillatsSetResponseCallback partial_callback(whisperPartialCallback, nullptr);
+    WhillatsTranscriber whisper(opts.whisper_model.c_str(),
+                                opts.whisper_fast_model.empty() ? nullptr : opts.whisper_fast_model.c_str(),
+                                callback, partial_callback);
 
     // Start the transcriber before processing audio
     if (!whisper.start()) 
@@ -133,6 +266,11 @@ int main(int argc, char *argv[])
       }
       whisper_done = false;
 
+      // Move finals to the fast model while the long audio streams in, as
+      // rolling out a new quantization would
+      const uint64_t swaps_before = whisper.getStats().model_swaps;
+      const bool swapping = !opts.whisper_fast_model.empty() && whisper.swapModel(opts.whisper_fast_model.c_str());
+
       // Process long audio
       std::cout << "\nProcessing long audio..." << std::endl;
       for (size_t i = 0; i < audio_buffer.size(); i += samples_per_chunk)
@@ -147,6 +285,51 @@ int main(int argc, char *argv[])
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
       }
 
+      if (swapping)
+      {
+        for (int wait = 0; wait < 600 && whisper.getStats().model_swaps == swaps_before; ++wait)
+        {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        if (whisper.getStats().model_swaps != swaps_before + 1)
+        {
+          LOG_E("Whisper model swap to " << opts.whisper_fast_model << " did not take effect");
+        }
+      }
+
+      WhillatsTranscriberStats stats = whisper.getStats();
+      LOG_I("Whisper latency: partial avg " << stats.partial_latency_avg_ms << " ms over " << stats.partials
+            << ", final avg " << stats.final_latency_avg_ms << " ms over " << stats.finals
+            << ", quality " << static_cast<int>(stats.quality) << " at rtf " << stats.real_time_factor
+            << ", " << stats.model_swaps << " swaps, last " << stats.model_swap_ms << " ms, peak resident "
+            << stats.model_swap_peak_bytes / (1024 * 1024) << " MiB");
+
+      // Typed ingest at telephony, wideband and studio rates, in small odd chunks
+      for (int rate : {8000, 16000, 48000})
+      {
+        for (int channels : {1, 2})
+        {
+          const std::vector<int16_t> pcm = makeIngestInput<int16_t>(rate, channels);
+          const std::vector<float> pcmf = makeIngestInput<float>(rate, channels);
+          const std::vector<uint8_t> ulaw = makeIngestInput<uint8_t>(rate, channels);
+          const size_t frames = rate;
+          for (size_t chunk : {7, 13, 161})
+          {
+            for (size_t pos = 0; pos < frames; pos += chunk)
+            {
+              const size_t n = std::min(chunk, frames - pos);
+              std::vector<int16_t> a(pcm.begin() + pos * channels, pcm.begin() + (pos + n) * channels);
+              std::vector<float> b(pcmf.begin() + pos * channels, pcmf.begin() + (pos + n) * channels);
+              std::vector<uint8_t> c(ulaw.begin() + pos * channels, ulaw.begin() + (pos + n) * channels);
+              whisper.processAudioInt16(a.data(), n, rate, channels);
+              whisper.processAudioFloat(b.data(), n, rate, channels);
+              whisper.processAudioMuLaw(c.data(), n, rate, channels);
+            }
+          }
+        }
+      }
+      LOG_I("Typed ingest done, lag " << whisper.getStats().lag_ms << " ms");
+
       // Stop the transcriber
       whisper.stop(); 
     }
@@ -156,8 +339,19 @@ int main(int argc, char *argv[])
     //  Test LlamaDeviceBase
     WhillatsSetResponseCallback callback(llamaResponseCallback, nullptr);
     WhillatsLlama llama(opts.llama_model.c_str(), callback);
+    WhillatsLlamaConfig config;
+    config.n_ctx = 8192;
+    config.n_batch = 512;
+    config.n_ubatch = 256;
+    config.warmup = true;
+    llama.setConfig(config);
 
     LOG_I("Initializing Llama with model: " << opts.llama_model);
+    WhillatsSegmentConfig segments;
+    segments.max_delay_ms = 400;
+    llama.setSegmentation(segments);
+    llama.setSystemPrompt("You are a concise voice assistant. Answer in one or two short sentences.");
+    llama.setTokenCallback(WhillatsSetTokenCallback(llamaTokenCallback, nullptr));
     if (llama.start()) 
     {
 
@@ -169,7 +363,300 @@ int main(int argc, char *argv[])
       {
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
       }
+      llama_done = false;
+
+      // Follow-up turn, answered from the dialogue already in the KV cache
+      std::string follow_up = "And if we add 3 more?";
+      LOG_I("Testing Llama with follow-up: " << follow_up);
+      llama.askLlama(follow_up.c_str());
+
+      while (!llama_done)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+
+      // Barge-in: the long answer is cut short and the new question answered
+      // from the dialogue as it was before it
+      llama.askLlama("Tell me a long story about a lighthouse keeper.");
+      std::this_thread::sleep_for(std::chrono::milliseconds(500));
+      llama_done = false;
+      llama.replace("Actually, what was the last number again?");
+      while (!llama_done)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+
+      // A tight time budget: the answer wraps up at a clause boundary and the
+      // done callback tells why it ended
+      bool budget_done = false;
+      llama.setDoneCallback(WhillatsSetDoneCallback(llamaDoneCallback, &budget_done));
+      WhillatsLlamaBudget budget;
+      budget.max_time_ms = 1500;
+      llama.askLlama("Explain in detail how a lighthouse lens works.", 0, 0, budget);
+      while (!budget_done)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+
+      // Sampling cost per token, the default chain against plain greedy
+      for (int greedy = 0; greedy < 2; ++greedy)
+      {
+        WhillatsSamplerConfig sampler;
+        if (greedy)
+        {
+          sampler.mode = WhillatsSamplerMode::Greedy;
+        }
+        llama.setSampler(sampler);
+        budget_done = false;
+        llama.askLlama("Name three rivers.");
+        while (!budget_done)
+        {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        LOG_I("Sampling " << (greedy ? "greedy" : "min_p") << ": " << llama.getStats().sample_us
+              << " us per token");
+      }
+      llama.setSampler(WhillatsSamplerConfig());
+
+      WhillatsLlamaStats stats = llama.getStats();
+      LOG_I("Llama session start " << stats.session_start_ms << " ms vs prefix prefill "
+            << stats.prefix_prefill_ms << " ms, last TTFT " << stats.ttft_ms << " ms with "
+            << stats.prefill_tokens << " prefill tokens, " << stats.inter_token_ms << " ms between tokens, "
+            << stats.context_shifts << " context shifts, " << stats.cancellations << " cancelled, "
+            << stats.queue_wait_avg_ms << " ms avg queue wait, " << stats.budget_stops << " budget stops");
+      LOG_I("Llama segments: " << stats.segments << " of " << stats.segment_chars_avg << " chars avg, held "
+            << stats.segment_latency_avg_ms << " ms avg, " << stats.segment_latency_max_ms << " ms max");
+
+      // A second chat on the same model shares the engine, both turns decode
+      // in the same batches
+      bool concurrent_done = false;
+      WhillatsLlama second(opts.llama_model.c_str(),
+                           WhillatsSetResponseCallback(llamaConcurrentCallback, &concurrent_done));
+      if (second.start())
+      {
+        LOG_I("Second session got the resident model in " << second.getStats().model_acquire_ms
+              << " ms, loading it took " << second.getStats().model_load_ms << " ms");
+        llama_done = false;
+        llama.askLlama("Name three colors.");
+        second.askLlama("Name three animals.");
+        while (!llama_done || !concurrent_done)
+        {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        // Let both turns run to the end before reading the totals
+        std::this_thread::sleep_for(std::chrono::milliseconds(2000));
+
+        stats = llama.getStats();
+        LOG_I("Llama engine " << stats.engine_tokens_per_s << " tokens/s, "
+              << stats.engine_batch_jobs_avg << " sessions per decode step");
+        second.stop();
+      }
+
+      // The same first question in two calls, the second is replayed from
+      // the response cache. "2+2" and "22" differ only in punctuation and
+      // must not share an answer.
+      llama.setResponseCache(1 << 20, 60000);
+      const uint64_t hits_before = llama.getStats().cache_hits;
+      const char *cache_prompts[] = {"What are your hours?", "what are your hours", "What is 2+2?", "What is 22?"};
+      for (int call = 0; call < 4; ++call)
+      {
+        llama.resetConversation();
+        llama_done = false;
+        llama.askLlama(cache_prompts[call]);
+        while (!llama_done)
+        {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(2000));
+        stats = llama.getStats();
+        LOG_I("Call " << call << ": first answer in " << stats.ttft_ms << " ms, cache " << stats.cache_hits
+              << " hits, " << stats.cache_misses << " misses, " << stats.cache_bytes << " bytes");
+      }
+      if (stats.cache_hits > hits_before + 1)
+      {
+        LOG_E("Response cache answered " << stats.cache_hits - hits_before << " of 4 prompts, only the repeat should hit");
+      }
+      llama.setResponseCache(0, 0);
+
+      // Prefill speed against prompt length, each from a fresh session
+      for (int repeats : {4, 16, 64, 128})
+      {
+        std::string long_prompt = "Summarize this in one sentence:";
+        for (int i = 0; i < repeats; ++i)
+        {
+          long_prompt += " The meeting moved to Tuesday because the room was booked.";
+        }
+        llama.resetConversation();
+        llama_done = false;
+        llama.askLlama(long_prompt.c_str());
+        while (!llama_done)
+        {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(2000));
+
+        stats = llama.getStats();
+        LOG_I("Prefill of " << stats.prefill_tokens << " tokens in " << stats.prefill_ms << " ms, "
+              << stats.prefill_tokens_per_s << " tokens/s");
+
+        // Restoring the same history from a saved session instead
+        if (llama.saveSession("llama_session.bin") && llama.loadSession("llama_session.bin"))
+        {
+          stats = llama.getStats();
+          LOG_I("Session of " << stats.context_tokens << " tokens, " << stats.session_file_bytes
+                << " bytes: saved in " << stats.session_save_ms << " ms, restored in "
+                << stats.session_restore_ms << " ms vs " << stats.prefill_ms << " ms prefill");
+        }
+      }
       llama.stop();
+
+      // Speculative decoding benchmark, the same prompt in each mode. The
+      // prompt asks for an echo, which prompt lookup can draft from.
+      WhillatsLlama spec(opts.llama_model.c_str(), callback);
+      if (!opts.llama_draft_model.empty())
+      {
+        spec.setDraftModel(opts.llama_draft_model.c_str());
+      }
+      if (spec.start())
+      {
+        const WhillatsSpeculativeMode modes[] = {WhillatsSpeculativeMode::None,
+                                                 WhillatsSpeculativeMode::PromptLookup,
+                                                 WhillatsSpeculativeMode::DraftModel};
+        const char *names[] = {"none", "prompt lookup", "draft model"};
+        const int n_modes = opts.llama_draft_model.empty() ? 2 : 3;
+        for (int i = 0; i < n_modes; ++i)
+        {
+          WhillatsLlamaStats before = spec.getStats();
+          spec.setSpeculativeMode(modes[i]);
+          spec.resetConversation();
+          llama_done = false;
+          spec.askLlama("Repeat after me: the quick brown fox jumps over the lazy dog, "
+                        "the quick brown fox jumps over the lazy dog.");
+          while (!llama_done)
+          {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+          }
+          std::this_thread::sleep_for(std::chrono::milliseconds(3000));
+
+          stats = spec.getStats();
+          const uint64_t drafted = stats.draft_tokens - before.draft_tokens;
+          const uint64_t accepted = stats.draft_accepted - before.draft_accepted;
+          LOG_I("Speculative " << names[i] << ": "
+                << (stats.inter_token_ms > 0 ? 1000.0 / stats.inter_token_ms : 0) << " tokens/s, "
+                << accepted << " of " << drafted << " drafts accepted, "
+                << stats.tokens_per_step << " tokens per decode");
+        }
+        spec.stop();
+      }
+
+      // KV cache types, memory per session against decode speed. Every
+      // setting gets its own engine, the ones before are stopped.
+      struct KVSetting {
+        const char *name;
+        WhillatsKVCacheType type_k;
+        WhillatsKVCacheType type_v;
+        bool flash_attn;
+      };
+      const KVSetting kv_settings[] = {
+          {"f16", WhillatsKVCacheType::F16, WhillatsKVCacheType::F16, false},
+          {"f16 flash", WhillatsKVCacheType::F16, WhillatsKVCacheType::F16, true},
+          {"q8_0 flash", WhillatsKVCacheType::Q8_0, WhillatsKVCacheType::Q8_0, true},
+          {"q4_0 flash", WhillatsKVCacheType::Q4_0, WhillatsKVCacheType::Q4_0, true}};
+      for (const KVSetting &setting : kv_settings)
+      {
+        WhillatsLlama kv(opts.llama_model.c_str(), callback);
+        WhillatsLlamaConfig kv_config = config;
+        kv_config.type_k = setting.type_k;
+        kv_config.type_v = setting.type_v;
+        kv_config.flash_attn = setting.flash_attn;
+        kv.setConfig(kv_config);
+        if (!kv.start())
+        {
+          continue;
+        }
+        llama_done = false;
+        kv.askLlama("Describe a lighthouse in three sentences.");
+        while (!llama_done)
+        {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(3000));
+
+        stats = kv.getStats();
+        LOG_I("KV cache " << setting.name << ": " << stats.kv_bytes_per_token << " bytes/token, "
+              << stats.kv_session_bytes / 1024 << " KiB for a " << stats.context_tokens << " token session, "
+              << stats.kv_total_bytes / (1024 * 1024) << " MiB total, "
+              << (stats.inter_token_ms > 0 ? 1000.0 / stats.inter_token_ms : 0) << " tokens/s, prefill "
+              << stats.prefill_tokens_per_s << " tokens/s");
+        kv.stop();
+      }
+
+      // Routing, the draft model doubles as the small model for short turns
+      if (!opts.llama_draft_model.empty())
+      {
+        WhillatsLlama routed(opts.llama_model.c_str(), callback);
+        routed.setConfig(config);
+        const int small = routed.addModel(opts.llama_draft_model.c_str(), 40);
+        routed.addRoutingKeyword("explain", 0);
+        if (small > 0 && routed.start())
+        {
+          const char *prompts[] = {"Okay, thanks.", "Got it.",
+                                   "Explain why the sky is blue.",
+                                   "What should I consider when choosing between renting and buying a home?"};
+          for (const char *prompt : prompts)
+          {
+            llama_done = false;
+            routed.askLlama(prompt);
+            while (!llama_done)
+            {
+              std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2000));
+            LOG_I("Routed '" << prompt << "' to model " << routed.getStats().route_model);
+          }
+          for (const WhillatsLlamaModelStats &model : routed.getModelStats())
+          {
+            LOG_I("Model " << model.model_path << ": " << model.turns << " turns, TTFT avg "
+                  << model.ttft_avg_ms << " ms");
+          }
+          routed.stop();
+        }
+      }
+      {
+        // Hot swap mid dialogue, the second answer comes from the new model
+        WhillatsLlama swapped(opts.llama_model.c_str(), callback);
+        swapped.setConfig(config);
+        if (!opts.llama_draft_model.empty() && swapped.start())
+        {
+          llama_done = false;
+          swapped.askLlama("My name is Ana, please remember it.");
+          while (!llama_done)
+          {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+          }
+          if (swapped.swapModel(opts.llama_draft_model.c_str()))
+          {
+            for (int wait = 0; wait < 600 && swapped.getStats().model_swaps == 0; ++wait)
+            {
+              std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+          }
+          llama_done = false;
+          swapped.askLlama("What is my name?");
+          while (!llama_done)
+          {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+          }
+          WhillatsLlamaStats swapStats = swapped.getStats();
+          if (swapStats.model_swaps != 1)
+          {
+            LOG_E("Llama model swap to " << opts.llama_draft_model << " did not take effect");
+          }
+          LOG_I("Model swap " << swapStats.model_swap_ms << " ms, peak "
+                << swapStats.model_swap_peak_bytes / (1024 * 1024) << " MiB");
+          swapped.stop();
+        }
+      }
     }
     else
     {